@@ -4,12 +4,236 @@ A revised conversion of the VB.NET code to C.
 Compile with a C99 compiler (e.g., MSVC or gcc).
 */
 
+/* clock_gettime(), fseeko() and friends are POSIX, not C99 */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
 #include <math.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+/* --- Portability --- */
+#ifndef _MSC_VER
+#define fopen_s(fp, name, mode) ((*(fp) = fopen((name), (mode))) == NULL)
+#define sprintf_s snprintf
+#define strcpy_s(dst, size, src) snprintf((dst), (size), "%s", (src))
+#define strncpy_s(dst, size, src, trunc) snprintf((dst), (size), "%s", (src))
+#define sscanf_s sscanf
+#endif
+
+#ifdef _MSC_VER
+#define FileSeek _fseeki64
+#define FileTell _ftelli64
+#else
+#define FileSeek fseeko
+#define FileTell ftello
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#ifdef _WIN32
+typedef HANDLE Thread_Handle;
+typedef CRITICAL_SECTION Mutex_Handle;
+typedef CONDITION_VARIABLE Cond_Handle;
+typedef SOCKET Socket_Handle;
+#define THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+#define CloseSocket closesocket
+#define MSG_NOSIGNAL 0
+
+static int StartThread(Thread_Handle* t, LPTHREAD_START_ROUTINE fn, void* arg) {
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t != NULL;
+}
+
+static void JoinThread(Thread_Handle t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static void YieldThread() {
+    SwitchToThread();
+}
+
+static long AtomicLoad(volatile long* p) {
+    return InterlockedCompareExchange(p, 0, 0);
+}
+
+static void AtomicStore(volatile long* p, long v) {
+    InterlockedExchange(p, v);
+}
+
+static long AtomicIncrement(volatile long* p) {
+    return InterlockedIncrement(p);
+}
+
+static long AtomicDecrement(volatile long* p) {
+    return InterlockedDecrement(p);
+}
+
+static double NowSeconds() {
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+}
+
+static int CpuCount() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+static void MutexInit(Mutex_Handle* m) { InitializeCriticalSection(m); }
+static void MutexLock(Mutex_Handle* m) { EnterCriticalSection(m); }
+static void MutexUnlock(Mutex_Handle* m) { LeaveCriticalSection(m); }
+static void CondInit(Cond_Handle* c) { InitializeConditionVariable(c); }
+static void CondSignal(Cond_Handle* c) { WakeConditionVariable(c); }
+static void MutexFree(Mutex_Handle* m) { DeleteCriticalSection(m); }
+static void CondFree(Cond_Handle* c) { (void)c; }
+
+static void CondWait(Cond_Handle* c, Mutex_Handle* m, int ms) {
+    SleepConditionVariableCS(c, m, ms);
+}
+
+/* Last modification time in seconds, or -1 if the file does not exist */
+static double FileTime(const char* path) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return -1;
+    return ((double)data.ftLastWriteTime.dwHighDateTime * 4294967296.0 + data.ftLastWriteTime.dwLowDateTime) / 1e7;
+}
+
+static int RenameFile(const char* from, const char* to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static int IsDirectory(const char* path) {
+    DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+static void MakeDirectory(const char* path) {
+    CreateDirectoryA(path, NULL);
+}
+#else
+typedef pthread_t Thread_Handle;
+typedef pthread_mutex_t Mutex_Handle;
+typedef pthread_cond_t Cond_Handle;
+typedef int Socket_Handle;
+#define THREAD_FUNC(name) void* name(void* arg)
+#define THREAD_RETURN return NULL
+#define CloseSocket close
+#define INVALID_SOCKET -1
+
+static int StartThread(Thread_Handle* t, void* (*fn)(void*), void* arg) {
+    return pthread_create(t, NULL, fn, arg) == 0;
+}
+
+static void JoinThread(Thread_Handle t) {
+    pthread_join(t, NULL);
+}
+
+static void YieldThread() {
+    sched_yield();
+}
+
+/* Sequentially consistent, like the Interlocked functions, so a ring index
+   store followed by a load of the waiter count cannot be reordered */
+static long AtomicLoad(volatile long* p) {
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void AtomicStore(volatile long* p, long v) {
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static long AtomicIncrement(volatile long* p) {
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static long AtomicDecrement(volatile long* p) {
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static double NowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int CpuCount() {
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static void MutexInit(Mutex_Handle* m) { pthread_mutex_init(m, NULL); }
+static void MutexLock(Mutex_Handle* m) { pthread_mutex_lock(m); }
+static void MutexUnlock(Mutex_Handle* m) { pthread_mutex_unlock(m); }
+static void CondInit(Cond_Handle* c) { pthread_cond_init(c, NULL); }
+static void CondSignal(Cond_Handle* c) { pthread_cond_signal(c); }
+static void MutexFree(Mutex_Handle* m) { pthread_mutex_destroy(m); }
+static void CondFree(Cond_Handle* c) { pthread_cond_destroy(c); }
+
+static void CondWait(Cond_Handle* c, Mutex_Handle* m, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    pthread_cond_timedwait(c, m, &ts);
+}
+
+/* Last modification time in seconds, or -1 if the file does not exist */
+static double FileTime(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    return (double)st.st_mtime;
+}
+
+static int RenameFile(const char* from, const char* to) {
+    return rename(from, to) == 0;
+}
+
+static int IsDirectory(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void MakeDirectory(const char* path) {
+    mkdir(path, 0777);
+}
+#endif
+
 /* --- Type definitions --- */
 
 typedef struct {
@@ -48,53 +272,351 @@ typedef struct {
     Voice_Struct Voice;
 } CurrVoice_Struct;
 
-/* --- Global variables --- */
+/* Growable in-memory output file */
+typedef struct {
+    uint8_t* Data;
+    size_t Length;
+    size_t Capacity;
+} OutBuf_Struct;
+
+#define RING_SLOTS 8
+#define RING_SPINS 64           // yields before a waiting side blocks
+#define RING_WAIT_MS 100
+
+/* Bounded single-producer/single-consumer ring of fixed-size buffers */
+typedef struct {
+    uint8_t* Data[RING_SLOTS];
+    int Length[RING_SLOTS];
+    long Position[RING_SLOTS]; // input ring: file position of each slot's first byte
+    int SlotSize;
+    FILE* File;             // file read or written by the ring's worker thread
+    OutBuf_Struct* Out;     // written instead of File when set
+    volatile long Head;     // slots published by the producer
+    volatile long Tail;     // slots released by the consumer
+    volatile long Stop;     // set by either side to abandon the stream
+    volatile long Waiting;  // threads blocked on Wake
+    volatile long SkipTo;   // input ring: the parser resumes here, so seek rather than read up to it
+    Mutex_Handle Lock;
+    Cond_Handle Wake;
+    long long FullStalls;   // producer waits (backpressure)
+    long long EmptyStalls;  // consumer waits
+    long long Skipped;      // input ring: bytes seeked over instead of read
+    long long OccupancySum;
+    long long OccupancySamples;
+    int OccupancyMax;
+} Ring_Struct;
+
+#define GM_FEATURES 37
+
+/* Reference voice labelled with a General MIDI program */
+typedef struct {
+    Voice_Struct Voice;
+    int Program;
+    double Features[GM_FEATURES];
+} GMVoice_Struct;
+
+/* Vantage-point tree node: items closer than Radius to the vantage item are in Inside */
+typedef struct {
+    int Item;
+    double Radius;
+    int Inside;
+    int Outside;
+} VPNode_Struct;
+
+/* One VGM file in the corpus index */
+typedef struct {
+    char Path[260];
+    char Title[128];
+    char Game[128];
+    char System[64];
+    char Author[128];
+    char Date[32];
+    uint32_t Clock;         // YM2151 clock, 0 if the chip is not used
+    uint32_t Version;
+    uint32_t TotalSamples;
+    uint32_t LoopSamples;
+    uint32_t FileSize;
+    uint32_t Voices;
+    uint64_t Fingerprint;   // 64-bit Bloom signature of the voices used
+    int Valid;
+} IndexEntry_Struct;
+
+typedef struct {
+    int Delay;        // samples since the previous queued event
+    int Command;
+    int Param1;
+    int Param2;
+    int Keep;
+    int Previous;     // previous event whose velocity or CC11 waits on the same note, or -1
+} MidiEvent_Struct;
+
+typedef struct {
+    char Path[260];
+    double Queued;          // time of the first event since the last conversion
+    double Ready;           // not converted before this time, so bursts of writes settle
+    int Busy;               // a worker is converting it
+    int Again;              // changed again while being converted
+} WatchJob_Struct;
+
+typedef struct {
+    char Path[260];
+    double Latency;         // from the first event to the outputs being in place
+    double Convert;
+    int Ok;
+} WatchRecent_Struct;
+
+typedef struct {
+    char Path[260];
+    char Name[260];         // entry name without extension, relative to the input given
+} PackInput_Struct;
+
+/* --- Global variables ---
+   Options are shared by every conversion; the state of a conversion is
+   thread-local so that the watch daemon can run several at once. */
 int Debug = 0;
+int Verbose = 1;            // conversion reports, off in the watch daemon
+
+THREAD_LOCAL FILE* in_file = NULL;
+THREAD_LOCAL FILE* out_file_midi = NULL;
+THREAD_LOCAL FILE* out_file_syx = NULL;
+THREAD_LOCAL FILE* out_file_opm = NULL;
+THREAD_LOCAL OutBuf_Struct OutMidi;     // MIDI output when packing, out_file_midi is NULL then
+THREAD_LOCAL OutBuf_Struct OutSyx;
+THREAD_LOCAL OutBuf_Struct OutOpm;
+
+THREAD_LOCAL int filepos = 0;
+THREAD_LOCAL int filelength = 0;
+THREAD_LOCAL uint8_t d[4] = { 0,0,0,0 };
+THREAD_LOCAL int delay_val = 0;
+THREAD_LOCAL int delay_ticks = 0;      // ticks of events dropped by FlushMidiEvents(), added to the next event
+THREAD_LOCAL int ym_reg = 0;
+THREAD_LOCAL int ym_val = 0;
 
-FILE* in_file = NULL;
-FILE* out_file_midi = NULL;
-FILE* out_file_syx = NULL;
-FILE* out_file_opm = NULL;
-
-int filepos = 0;
-int filelength = 0;
-uint8_t d[4] = { 0,0,0,0 };
-int delay_val = 0;
-int ym_reg = 0;
-int ym_val = 0;
-
-int Note[8] = { -2,-2,-2,-2,-2,-2,-2,-2 };
-int Note_Old[8];
-int NoteOn[8] = { 0,0,0,0,0,0,0,0 };
-int NoteOn_Old[8] = { 0,0,0,0,0,0,0,0 };
-int SlotArr[8] = { 0,0,0,0,0,0,0,0 };
-int KF[8] = { -2,-2,-2,-2,-2,-2,-2,-2 };
-int KF_old[8] = { -1,-1,-1,-1,-1,-1,-1,-1 };
-
-int MIDIByteCount = 0;
-
-uint8_t Registers[256] = { 0 };
-
-int AMD_val = 0;
-int PMD_val = 0;
-int RegisterChanged = 0;
-
-CurrVoice_Struct CurrentVoice[8];
-Voice_Struct* Voices = NULL;
-int VoicesCount = 0;
-int VoiceID[8] = { -2,-2,-2,-2,-2,-2,-2,-2 };
-int VoiceID_old[8] = { -1,-1,-1,-1,-1,-1,-1,-1 };
-int VolumeChangeAmount_old[8] = { -1,-1,-1,-1,-1,-1,-1,-1 };
+THREAD_LOCAL int Note[8] = { -2,-2,-2,-2,-2,-2,-2,-2 };
+THREAD_LOCAL int Note_Old[8];
+THREAD_LOCAL int NoteOn[8] = { 0,0,0,0,0,0,0,0 };
+THREAD_LOCAL int NoteOn_Old[8] = { 0,0,0,0,0,0,0,0 };
+THREAD_LOCAL int SlotArr[8] = { 0,0,0,0,0,0,0,0 };
+THREAD_LOCAL int KF[8] = { -2,-2,-2,-2,-2,-2,-2,-2 };
+THREAD_LOCAL int KF_old[8] = { -1,-1,-1,-1,-1,-1,-1,-1 };
+
+THREAD_LOCAL int MIDIByteCount = 0;
+
+THREAD_LOCAL uint8_t Registers[256] = { 0 };
+
+THREAD_LOCAL int AMD_val = 0;
+THREAD_LOCAL int PMD_val = 0;
+THREAD_LOCAL int RegisterChanged = 0;
+
+THREAD_LOCAL CurrVoice_Struct CurrentVoice[8];
+THREAD_LOCAL Voice_Struct* Voices = NULL;
+THREAD_LOCAL int VoicesCount = 0;
+THREAD_LOCAL int VoicesCapacity = 0;
+THREAD_LOCAL int VoiceID[8] = { -2,-2,-2,-2,-2,-2,-2,-2 };
+THREAD_LOCAL int VoiceID_old[8] = { -1,-1,-1,-1,-1,-1,-1,-1 };
+THREAD_LOCAL int VolumeChangeAmount_old[8] = { -1,-1,-1,-1,-1,-1,-1,-1 };
 int TL_Tol = 0;
-double MaxVol = 0;
+THREAD_LOCAL double MaxVol = 0;
 double Gain = 1.0;
 double BPM = 120;
 int TQN = 96;
 
+/* Pitch-bend thinning (-pb_err / -pb_min) */
+double PB_MaxErr = 0;
+int PB_MinTicks = 0;
+THREAD_LOCAL int MidiDeferred = 0;
+THREAD_LOCAL MidiEvent_Struct* MidiEvents = NULL;
+THREAD_LOCAL int MidiEventsCount = 0;
+THREAD_LOCAL int MidiEventsCapacity = 0;
+
+/* General MIDI program mapping (-gm / -gm_lib) */
+int GMMap = 0;
+GMVoice_Struct* GMLibrary = NULL;
+int GMLibraryCount = 0;
+VPNode_Struct* GMTree = NULL;
+int GMTreeCount = 0;
+int GMRoot = -1;
+THREAD_LOCAL int* GMPrograms = NULL;         // mapped program for each entry of Voices
+THREAD_LOCAL double* GMDistances = NULL;
+THREAD_LOCAL int GMProgramsCount = 0;
+
+/* Envelope generator model (-eg / -expr) */
+#define EG_MAX 1023.0f          // attenuation steps of 0.09375 dB
+#define EG_ATTACK_STEPS 14.0f   // attenuation a linear attack covers per chip increment
+#define EG_WINDOW 0.1           // seconds of a note's start that set its velocity
+#define EG_WINDOW_STEP 44       // samples per model step while a velocity is measured
+int EGModel = 0;
+int EGExpression = 0;
+int EGBench = 0;
+THREAD_LOCAL double YMClock = 3579545;
+THREAD_LOCAL float EG_Level[32];             // operators in register order: chan + op * 8
+THREAD_LOCAL float EG_Slope[32];             // steps per EG tick in the current phase
+THREAD_LOCAL float EG_Low[32];
+THREAD_LOCAL float EG_High[32];
+THREAD_LOCAL int EG_Phase[32];
+THREAD_LOCAL float EG_AttackEnd[32];         // 0 in attack, else below any level
+THREAD_LOCAL float EG_DecayEnd[32];          // the D1L level in first decay, else above any level
+THREAD_LOCAL float EG_TicksPerSample;
+THREAD_LOCAL int EG_Dirty[8];
+THREAD_LOCAL int Expression_old[8];
+THREAD_LOCAL int EG_Velocity[8];             // velocity of the channel's sounding note
+THREAD_LOCAL int EG_Pending[8];              // the channel's note velocity is still being measured
+THREAD_LOCAL int EG_PendingLast[8];          // last queued note-on or CC11 of the measured note, or -1
+THREAD_LOCAL int EG_PendingCount = 0;
+THREAD_LOCAL int EG_Owed = 0;                // samples waited but not yet modelled
+THREAD_LOCAL double EG_Sum[8];               // integral of the carrier's MIDI level over EG_Held
+THREAD_LOCAL double EG_Held[8];
+THREAD_LOCAL int EG_Last[8];
+THREAD_LOCAL int EG_Peak[8];                 // loudest carrier MIDI level of the note so far, for -expr
+THREAD_LOCAL int EG_Topped[32];              // the operator finished its attack in the last step
+THREAD_LOCAL double EGTime = 0;
+THREAD_LOCAL double LastConvertTime = 0;    // parse time of the last ConvertFile(), for -eg_bench
+THREAD_LOCAL long long EGBatches = 0;
+
+/* Frame batching (-frame) */
+int FrameBatch = 0;
+THREAD_LOCAL int FrameTouched[8];
+THREAD_LOCAL int FrameOn[8];             // key state as the frame's writes leave it
+THREAD_LOCAL int FrameOffSeen[8];
+THREAD_LOCAL int FrameKey[8];            // last value written to 0x08 for the channel, -1 if none
+THREAD_LOCAL int FrameKC[8];
+THREAD_LOCAL int FrameKF[8];
+THREAD_LOCAL long long FrameBatched = 0;
+THREAD_LOCAL long long FrameApplied = 0;
+
+/* Pipelined mode (-pipe) */
+#define READ_CHUNK (1 << 20)
+#define MIDI_CHUNK (1 << 16)
+int Pipelined = 0;
+THREAD_LOCAL Ring_Struct ReadRing;
+THREAD_LOCAL Ring_Struct WriteRing;
+THREAD_LOCAL Thread_Handle ReadThread;
+THREAD_LOCAL Thread_Handle WriteThread;
+THREAD_LOCAL uint8_t* InChunk = NULL;      // slot currently being parsed
+THREAD_LOCAL int InChunkLen = 0;
+THREAD_LOCAL int InChunkPos = 0;
+THREAD_LOCAL long InPos = 0;               // absolute file position of the parser
+THREAD_LOCAL int InEnd = 0;
+THREAD_LOCAL uint8_t* MidiBuf = NULL;      // buffer currently being filled by Send_Midi()
+THREAD_LOCAL uint8_t* MidiOwnBuf = NULL;
+THREAD_LOCAL int MidiBufLen = 0;
+
+/* Corpus index (index / query) */
+#define INDEX_VERSION 1
+#define INDEX_RECORD_SIZE 56
+IndexEntry_Struct* IndexEntries = NULL;
+int IndexCount = 0;
+int IndexCapacity = 0;
+volatile long IndexNext = 0;
+
+/* Watch daemon (watch) */
+#define WATCH_RECENT 16
+#ifdef _WIN32
+#define WATCH_SETTLE 0.5        // seconds without changes before a file counts as written
+#else
+#define WATCH_SETTLE 0.0        // inotify reports the close of the writer
+#endif
+char WatchOutDir[256];
+char WatchStatus[256];
+Mutex_Handle WatchLock;
+Cond_Handle WatchWake;
+WatchJob_Struct* WatchJobs = NULL;
+int WatchJobsCount = 0;
+int WatchJobsCapacity = 0;
+int WatchActive = 0;
+long long WatchConverted = 0;
+long long WatchFailed = 0;
+double WatchLatencyLast = 0;
+double WatchLatencySum = 0;
+double WatchLatencyMax = 0;
+WatchRecent_Struct WatchRecent[WATCH_RECENT];
+int WatchRecentNext = 0;
+
+/* Packed output (-pack / list / extract) */
+#define PACK_VERSION 1
+#define PACK_FOOTER_SIZE 20
+char PackPath[256];
+char** InputPaths = NULL;       // every input given on the command line
+int InputCount = 0;
+FILE* PackFile = NULL;
+long long PackTOCOffset = 0;
+OutBuf_Struct PackTOC;
+int PackCount = 0;
+PackInput_Struct* PackInputs = NULL;
+int PackInputsCount = 0;
+int PackInputsCapacity = 0;
+const char* PackEntryName = NULL;   // entry name of the file being converted into the pack
+
+/* Chrome trace output (-trace) */
+#define TRACE_KF_GAP 1470     // samples between KF writes that end a burst (two frames)
+THREAD_LOCAL FILE* out_file_trace = NULL;
+THREAD_LOCAL char TraceBuf[65536];
+THREAD_LOCAL int TraceLen = 0;
+THREAD_LOCAL int TraceEvents = 0;
+THREAD_LOCAL long long SampleTime = 0;
+THREAD_LOCAL long long FrameStart = 0;
+THREAD_LOCAL int FrameWrites = 0;
+THREAD_LOCAL int FrameMidi = 0;
+THREAD_LOCAL int FrameWrites_old = 0;
+THREAD_LOCAL int FrameMidi_old = 0;
+THREAD_LOCAL long long TraceNoteStart[8];
+THREAD_LOCAL int TraceNote[8];
+THREAD_LOCAL long long KFBurstStart[8];
+THREAD_LOCAL long long KFBurstLast[8];
+THREAD_LOCAL int KFBurstCount[8];
+
 /* --- Function prototypes --- */
 int KeyCodeToMIDINote(int data, int adjustOctave);
 
 /* --- Utility Functions --- */
+static void Info(const char* format, ...) {
+    va_list args;
+
+    if (!Verbose) return;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/* Buffers keep their allocation when Length is reset, so they are reused between files */
+static int OutReserve(OutBuf_Struct* out, size_t length) {
+    if (out->Length + length > out->Capacity) {
+        size_t newCapacity = out->Capacity ? out->Capacity : 4096;
+        while (newCapacity < out->Length + length) newCapacity *= 2;
+        uint8_t* temp = (uint8_t*)realloc(out->Data, newCapacity);
+        if (temp == NULL) {
+            fprintf(stderr, "Memory allocation failed in OutReserve()\n");
+            return 0;
+        }
+        out->Data = temp;
+        out->Capacity = newCapacity;
+    }
+    return 1;
+}
+
+static void OutWrite(OutBuf_Struct* out, const void* data, size_t length) {
+    if (!OutReserve(out, length)) return;
+    memcpy(out->Data + out->Length, data, length);
+    out->Length += length;
+}
+
+static void OutByte(OutBuf_Struct* out, int b) {
+    uint8_t c = (uint8_t)b;
+    OutWrite(out, &c, 1);
+}
+
+static void OutPrintf(OutBuf_Struct* out, const char* format, ...) {
+    char text[512];
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n >= (int)sizeof(text)) n = (int)sizeof(text) - 1;
+    if (n > 0) OutWrite(out, text, (size_t)n);
+}
+
 static int Carrier(int alg, int op) {
     int c = 0;
     if (op == 0) {           // M1
@@ -131,17 +653,474 @@ static void BytesToText(uint8_t* b, int l, char* out_str, size_t outSize) {
     out_str[l] = '\0';
 }
 
+/* --- Lock-free ring buffers ---
+   Only the producer writes Head and only the consumer writes Tail, so each side
+   needs one atomic load of the other's index and one atomic store of its own.
+   A full ring makes the producer wait, which bounds memory use. A waiting side
+   yields for a while and then sleeps on Wake, so an idle or backpressured stage
+   does not hold a core; the lock is only taken when someone is asleep. */
+static int RingInit(Ring_Struct* ring, int slotSize) {
+    int i;
+
+    memset(ring, 0, sizeof(Ring_Struct));
+    MutexInit(&ring->Lock);
+    CondInit(&ring->Wake);
+    ring->SlotSize = slotSize;
+    for (i = 0; i < RING_SLOTS; i++) {
+        ring->Data[i] = (uint8_t*)malloc(slotSize);
+        if (ring->Data[i] == NULL) return 0;
+    }
+    return 1;
+}
+
+static void RingFree(Ring_Struct* ring) {
+    int i;
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        free(ring->Data[i]);
+        ring->Data[i] = NULL;
+    }
+    MutexFree(&ring->Lock);
+    CondFree(&ring->Wake);
+}
+
+/* Sleep until the other side moves or the stream stops. The waiter count is
+   raised before the condition is checked again under the lock, so a wake-up
+   sent after the index store cannot be missed. */
+static void RingSleep(Ring_Struct* ring, volatile long* index, long blocked) {
+    MutexLock(&ring->Lock);
+    AtomicIncrement(&ring->Waiting);
+    if (AtomicLoad(index) == blocked && !AtomicLoad(&ring->Stop))
+        CondWait(&ring->Wake, &ring->Lock, RING_WAIT_MS);
+    AtomicDecrement(&ring->Waiting);
+    MutexUnlock(&ring->Lock);
+}
+
+static void RingWake(Ring_Struct* ring) {
+    if (AtomicLoad(&ring->Waiting) > 0) {
+        MutexLock(&ring->Lock);
+        CondSignal(&ring->Wake);
+        MutexUnlock(&ring->Lock);
+    }
+}
+
+/* Either side: abandon the stream and wake the other side */
+static void RingStop(Ring_Struct* ring) {
+    AtomicStore(&ring->Stop, 1);
+    RingWake(ring);
+}
+
+/* Producer: wait for a free slot, or return NULL if the consumer stopped */
+static uint8_t* RingAcquire(Ring_Struct* ring) {
+    long head = ring->Head;
+    int stalled = 0;
+
+    while (head - AtomicLoad(&ring->Tail) >= RING_SLOTS) {
+        if (AtomicLoad(&ring->Stop)) return NULL;
+        if (stalled++ == 0) ring->FullStalls++;
+        if (stalled < RING_SPINS) YieldThread();
+        else RingSleep(ring, &ring->Tail, head - RING_SLOTS);
+    }
+    return ring->Data[head % RING_SLOTS];
+}
+
+/* Producer: hand the acquired slot to the consumer; length 0 ends the stream */
+static void RingPublish(Ring_Struct* ring, int length) {
+    long head = ring->Head;
+    int occupancy = (int)(head - AtomicLoad(&ring->Tail)) + 1;
+
+    ring->Length[head % RING_SLOTS] = length;
+    ring->OccupancySum += occupancy;
+    ring->OccupancySamples++;
+    if (occupancy > ring->OccupancyMax) ring->OccupancyMax = occupancy;
+    AtomicStore(&ring->Head, head + 1);
+    RingWake(ring);
+}
+
+/* Consumer: wait for the next published slot, or return NULL with length 0
+   if the producer stopped */
+static uint8_t* RingPeek(Ring_Struct* ring, int* length) {
+    long tail = ring->Tail;
+    int stalled = 0;
+
+    while (AtomicLoad(&ring->Head) == tail) {
+        if (AtomicLoad(&ring->Stop)) {
+            *length = 0;
+            return NULL;
+        }
+        if (stalled++ == 0) ring->EmptyStalls++;
+        if (stalled < RING_SPINS) YieldThread();
+        else RingSleep(ring, &ring->Head, tail);
+    }
+    *length = ring->Length[tail % RING_SLOTS];
+    return ring->Data[tail % RING_SLOTS];
+}
+
+/* Consumer: give the slot back to the producer */
+static void RingRelease(Ring_Struct* ring) {
+    AtomicStore(&ring->Tail, ring->Tail + 1);
+    RingWake(ring);
+}
+
+static void RingReport(const char* name, Ring_Struct* ring) {
+    Info("%s ring: %lld producer stalls, %lld consumer stalls, occupancy %.2f average, %d maximum of %d\n",
+        name, ring->FullStalls, ring->EmptyStalls,
+        ring->OccupancySamples ? (double)ring->OccupancySum / ring->OccupancySamples : 0.0,
+        ring->OccupancyMax, RING_SLOTS);
+}
+
+/* --- Buffered input ---
+   In pipelined mode a reader thread fills READ_CHUNK slots from in_file and the
+   parser consumes them through ReadIn()/SeekIn(), which behave like the
+   fread()/fseek() calls they replace, including short reads at end of file.
+   A forward SeekIn() also posts its target in SkipTo, and the reader seeks
+   straight there if it has not read that far yet, so data blocks that the
+   parser skips are mostly never read. */
+static THREAD_FUNC(ReaderThread) {
+    Ring_Struct* ring = (Ring_Struct*)arg;
+    uint8_t* chunk;
+    long pos = ring->SkipTo, skipTo;
+    int length;
+
+    while (!AtomicLoad(&ring->Stop)) {
+        chunk = RingAcquire(ring);
+        if (chunk == NULL) break;
+        skipTo = AtomicLoad(&ring->SkipTo);
+        if (skipTo > pos && FileSeek(ring->File, skipTo, SEEK_SET) == 0) {
+            ring->Skipped += skipTo - pos;
+            pos = skipTo;
+        }
+        length = (int)fread(chunk, 1, ring->SlotSize, ring->File);
+        ring->Position[ring->Head % RING_SLOTS] = pos;
+        pos += length;
+        RingPublish(ring, length);
+        if (length == 0) break;
+    }
+    THREAD_RETURN;
+}
+
+static int NextInChunk() {
+    if (InEnd) return 0;
+    if (InChunk != NULL) RingRelease(&ReadRing);
+    InChunk = RingPeek(&ReadRing, &InChunkLen);
+    InChunkPos = 0;
+    if (InChunkLen == 0) {
+        if (InChunk != NULL) RingRelease(&ReadRing);
+        InChunk = NULL;
+        InEnd = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int ReadIn(uint8_t* dest, int count) {
+    int n = 0, avail;
+
+    if (!Pipelined) return (int)fread(dest, 1, count, in_file);
+
+    while (n < count) {
+        if (InChunk == NULL || InChunkPos == InChunkLen) {
+            if (!NextInChunk()) break;
+        }
+        avail = InChunkLen - InChunkPos;
+        if (avail > count - n) avail = count - n;
+        memcpy(dest + n, InChunk + InChunkPos, avail);
+        InChunkPos += avail;
+        n += avail;
+    }
+    InPos += n;
+    return n;
+}
+
+static void SeekIn(long pos) {
+    long skip;
+    int avail;
+
+    if (!Pipelined) {
+        fseek(in_file, pos, SEEK_SET);
+        return;
+    }
+
+    /* Data blocks only ever skip forward. Slots the reader has already filled are
+       passed over; a slot read after it saw SkipTo may start past InPos */
+    if (pos <= InPos) return;
+    AtomicStore(&ReadRing.SkipTo, pos);
+    while (InPos < pos) {
+        if (InChunk == NULL || InChunkPos == InChunkLen) {
+            if (!NextInChunk()) break;
+            InPos = ReadRing.Position[ReadRing.Tail % RING_SLOTS];
+            if (InPos >= pos) break;
+        }
+        skip = pos - InPos;
+        avail = InChunkLen - InChunkPos;
+        if (avail > skip) avail = (int)skip;
+        InChunkPos += avail;
+        InPos += avail;
+    }
+}
+
+static int StartReader(long pos) {
+    if (!RingInit(&ReadRing, READ_CHUNK)) return 0;
+    InChunk = NULL;
+    InChunkLen = InChunkPos = 0;
+    InPos = pos;
+    InEnd = 0;
+    ReadRing.File = in_file;
+    ReadRing.SkipTo = pos;
+    return StartThread(&ReadThread, ReaderThread, &ReadRing);
+}
+
+static void StopReader() {
+    /* The parser may stop before end of file (command 0x66) */
+    RingStop(&ReadRing);
+    JoinThread(ReadThread);
+    InChunk = NULL;
+    InEnd = 1;
+}
+
+/* --- Buffered MIDI output ---
+   Send_Midi() fills MIDI_CHUNK buffers. Sequentially they are written when full;
+   in pipelined mode they are handed to a writer thread instead. */
+static THREAD_FUNC(WriterThread) {
+    Ring_Struct* ring = (Ring_Struct*)arg;
+    uint8_t* chunk;
+    int length;
+
+    for (;;) {
+        chunk = RingPeek(ring, &length);
+        if (length == 0) {
+            if (chunk != NULL) RingRelease(ring);
+            break;
+        }
+        if (ring->Out != NULL)
+            OutWrite(ring->Out, chunk, length);
+        else
+            fwrite(chunk, 1, length, ring->File);
+        RingRelease(ring);
+    }
+    THREAD_RETURN;
+}
+
+static void FlushMidi() {
+    if (MidiBufLen == 0) return;
+    if (Pipelined) {
+        RingPublish(&WriteRing, MidiBufLen);
+        MidiBuf = RingAcquire(&WriteRing);
+    }
+    else if (out_file_midi == NULL) {
+        OutWrite(&OutMidi, MidiBuf, MidiBufLen);
+    }
+    else {
+        fwrite(MidiBuf, 1, MidiBufLen, out_file_midi);
+    }
+    MidiBufLen = 0;
+}
+
+static void MidiByte(int b) {
+    if (MidiBufLen == MIDI_CHUNK) FlushMidi();
+    MidiBuf[MidiBufLen++] = (uint8_t)b;
+}
+
+static int StartWriter() {
+    MidiBufLen = 0;
+    if (!Pipelined) {
+        /* Kept between conversions, like the voice table */
+        if (MidiOwnBuf == NULL) MidiOwnBuf = (uint8_t*)malloc(MIDI_CHUNK);
+        MidiBuf = MidiOwnBuf;
+        return MidiBuf != NULL;
+    }
+    if (!RingInit(&WriteRing, MIDI_CHUNK)) return 0;
+    WriteRing.File = out_file_midi;
+    WriteRing.Out = out_file_midi == NULL ? &OutMidi : NULL;
+    MidiBuf = RingAcquire(&WriteRing);
+    return StartThread(&WriteThread, WriterThread, &WriteRing);
+}
+
+static void StopWriter() {
+    FlushMidi();
+    if (!Pipelined) {
+        MidiBuf = NULL;
+        return;
+    }
+    RingPublish(&WriteRing, 0);
+    JoinThread(WriteThread);
+    MidiBuf = NULL;
+}
+
+/* --- Chrome trace output ---
+   Events are formatted into TraceBuf and written in large blocks, so tracing a
+   whole soundtrack costs little more than the conversion itself. Timestamps are
+   the VGM sample position converted to microseconds. Thread 0 holds the VGM
+   stream (data blocks and per-frame write density), threads 1-8 the channels. */
+static void TraceFlush() {
+    if (TraceLen > 0) {
+        fwrite(TraceBuf, 1, TraceLen, out_file_trace);
+        TraceLen = 0;
+    }
+}
+
+static void TracePrintf(const char* fmt, ...) {
+    va_list args;
+    int n;
+
+    if (TraceLen > (int)sizeof(TraceBuf) - 512)
+        TraceFlush();
+    if (TraceEvents++ > 0)
+        TraceBuf[TraceLen++] = ',';
+    va_start(args, fmt);
+    n = vsnprintf(TraceBuf + TraceLen, sizeof(TraceBuf) - TraceLen, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        if (n >= (int)sizeof(TraceBuf) - TraceLen) n = (int)sizeof(TraceBuf) - TraceLen - 1;
+        TraceLen += n;
+    }
+    TraceBuf[TraceLen++] = '\n';
+}
+
+static double TraceTs(long long samples) {
+    return samples * 1000000.0 / 44100.0;
+}
+
+static void TraceSpan(int tid, const char* name, long long start, long long end, const char* argName, int argVal) {
+    TracePrintf("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%d}}",
+        name, tid, TraceTs(start), TraceTs(end) - TraceTs(start), argName, argVal);
+}
+
+static int TraceOpen(const char* path) {
+    int chan;
+
+    if (fopen_s(&out_file_trace, path, "wb") != 0 || out_file_trace == NULL) {
+        out_file_trace = NULL;
+        return 0;
+    }
+    TraceLen = 0;
+    TraceEvents = 0;
+    FrameStart = 0;
+    FrameWrites = FrameMidi = 0;
+    FrameWrites_old = FrameMidi_old = -1;
+    for (chan = 0; chan < 8; chan++) {
+        TraceNote[chan] = -1;
+        KFBurstCount[chan] = 0;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out_file_trace);
+    TracePrintf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ym21512midi\"}}");
+    TracePrintf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"VGM\"}}");
+    for (chan = 0; chan < 8; chan++) {
+        TracePrintf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Channel %d\"}}", chan + 1, chan);
+    }
+    return 1;
+}
+
+/* Called at each wait: emit a counter sample when the frame's density changed */
+static void TraceFrame() {
+    if (FrameWrites != FrameWrites_old || FrameMidi != FrameMidi_old) {
+        TracePrintf("{\"name\":\"Frame\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"args\":{\"ym_writes\":%d,\"midi_events\":%d}}",
+            TraceTs(FrameStart), FrameWrites, FrameMidi);
+        FrameWrites_old = FrameWrites;
+        FrameMidi_old = FrameMidi;
+    }
+    FrameWrites = 0;
+    FrameMidi = 0;
+    FrameStart = SampleTime;
+}
+
+static void TraceNoteOn(int chan, int note) {
+    TraceNote[chan] = note;
+    TraceNoteStart[chan] = SampleTime;
+}
+
+static void TraceNoteOff(int chan) {
+    if (TraceNote[chan] >= 0)
+        TraceSpan(chan + 1, "Key on", TraceNoteStart[chan], SampleTime, "note", TraceNote[chan]);
+    TraceNote[chan] = -1;
+}
+
+static void TraceKF(int chan) {
+    if (KFBurstCount[chan] > 0 && SampleTime - KFBurstLast[chan] > TRACE_KF_GAP) {
+        TraceSpan(chan + 1, "KF burst", KFBurstStart[chan], KFBurstLast[chan], "writes", KFBurstCount[chan]);
+        KFBurstCount[chan] = 0;
+    }
+    if (KFBurstCount[chan] == 0)
+        KFBurstStart[chan] = SampleTime;
+    KFBurstLast[chan] = SampleTime;
+    KFBurstCount[chan]++;
+}
+
+static void TraceVoice(int chan, int voice, int previous, int discovered) {
+    TracePrintf("{\"name\":\"Voice %d\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"voice\":%d,\"previous\":%d,\"new\":%d}}",
+        voice, chan + 1, TraceTs(SampleTime), voice, previous, discovered);
+}
+
+static void TraceDataBlock(int type, uint32_t size) {
+    TracePrintf("{\"name\":\"Data block skip\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"args\":{\"type\":%d,\"bytes\":%u}}",
+        TraceTs(SampleTime), type, size);
+}
+
+static void TraceClose() {
+    int chan;
+
+    TraceFrame();
+    for (chan = 0; chan < 8; chan++) {
+        TraceNoteOff(chan);
+        if (KFBurstCount[chan] > 0)
+            TraceSpan(chan + 1, "KF burst", KFBurstStart[chan], KFBurstLast[chan], "writes", KFBurstCount[chan]);
+    }
+    TraceFlush();
+    fputs("]}\n", out_file_trace);
+    fclose(out_file_trace);
+    out_file_trace = NULL;
+}
+
 /* --- MIDI Output --- */
+static double SamplesPerTick() {
+    /* The VB formula: samples per quarter note divided by TQN */
+    double spt = 44100.0 / TQN;
+    return spt * 60 / BPM;
+}
+
+static void QueueMidi(int Command, int Param1, int Param2) {
+    if (MidiEventsCount == MidiEventsCapacity) {
+        int newCapacity = MidiEventsCapacity ? MidiEventsCapacity * 2 : 4096;
+        MidiEvent_Struct* temp = (MidiEvent_Struct*)realloc(MidiEvents, (size_t)newCapacity * sizeof(MidiEvent_Struct));
+        if (temp == NULL) {
+            fprintf(stderr, "Memory allocation failed in QueueMidi()\n");
+            return;
+        }
+        MidiEvents = temp;
+        MidiEventsCapacity = newCapacity;
+    }
+    MidiEvents[MidiEventsCount].Delay = delay_val;
+    MidiEvents[MidiEventsCount].Command = Command;
+    MidiEvents[MidiEventsCount].Param1 = Param1;
+    MidiEvents[MidiEventsCount].Param2 = Param2;
+    MidiEvents[MidiEventsCount].Keep = 1;
+    MidiEvents[MidiEventsCount].Previous = -1;
+    /* Chain the events EGEndVelocity() patches once the note's velocity is known */
+    if (EG_Pending[Command & 7] && ((Command & 0xF8) == 0x90 || ((Command & 0xF8) == 0xB0 && Param1 == 11))) {
+        MidiEvents[MidiEventsCount].Previous = EG_PendingLast[Command & 7];
+        EG_PendingLast[Command & 7] = MidiEventsCount;
+    }
+    MidiEventsCount++;
+    delay_val = 0;
+}
+
 static void Send_Midi(int Command, int Param1, int Param2) {
     uint8_t t[4] = { 0,0,0,0 };
     int delay2 = 0;
     double delay3 = 0;
 
+    if (out_file_trace) FrameMidi++;
+
+    if (MidiDeferred) {
+        QueueMidi(Command, Param1, Param2);
+        return;
+    }
+
     /* Calculate delay ticks using the VB formula */
-    delay3 = 44100.0 / TQN;
-    delay3 = delay3 * 60 / BPM;
-    delay3 = delay_val / delay3;
-    delay2 = (int)delay3;
+    delay3 = delay_val / SamplesPerTick();
+    delay2 = (int)delay3 + delay_ticks;
+    delay_ticks = 0;
 
     t[0] = (delay2 >> 21) & 127;
     t[1] = (delay2 >> 14) & 127;
@@ -149,50 +1128,181 @@ static void Send_Midi(int Command, int Param1, int Param2) {
     t[3] = delay2 & 127;
 
     if (t[0] != 0) {
-        fputc(t[0] | 128, out_file_midi);
+        MidiByte(t[0] | 128);
         MIDIByteCount++;
     }
     if (t[1] != 0) {
-        fputc(t[1] | 128, out_file_midi);
+        MidiByte(t[1] | 128);
         MIDIByteCount++;
     }
     if (t[2] != 0) {
-        fputc(t[2] | 128, out_file_midi);
+        MidiByte(t[2] | 128);
         MIDIByteCount++;
     }
-    fputc(t[3], out_file_midi);
+    MidiByte(t[3]);
     MIDIByteCount++;
 
     delay_val = 0;
 
     if (Command != -1) {
-        fputc(Command, out_file_midi);
+        MidiByte(Command);
         MIDIByteCount++;
     }
     if (Param1 != -1) {
-        fputc(Param1, out_file_midi);
+        MidiByte(Param1);
         MIDIByteCount++;
     }
     if (Param2 != -1) {
-        fputc(Param2, out_file_midi);
+        MidiByte(Param2);
         MIDIByteCount++;
     }
 }
 
-static void AddVoice(Voice_Struct v) {
-    Voice_Struct* temp = (Voice_Struct*)realloc(Voices, ((unsigned long long)(VoicesCount) + 1) * sizeof(Voice_Struct));
-    if (temp == NULL) {
-        fprintf(stderr, "Memory allocation failed in AddVoice()\n");
+/* Text meta event naming the discovered voice behind a program change */
+static void Send_VoiceText(int id) {
+    char text[32];
+    int i, len;
+
+    if (MidiDeferred) {
+        QueueMidi(0xFF, 0x01, id);      // FlushMidiEvents() formats the text
         return;
     }
+    len = sprintf_s(text, sizeof(text), "Voice %d", id);
+    Send_Midi(0xFF, 0x01, len);
+    for (i = 0; i < len; i++) {
+        MidiByte(text[i]);
+        MIDIByteCount++;
+    }
+}
 
-    Voices = temp;
-    Voices[VoicesCount] = v;
-    VoicesCount++;
+/* --- Pitch-bend thinning ---
+   While MidiDeferred is set, Send_Midi() queues events instead of writing them.
+   Each channel's pitch bends are split into segments by that channel's other
+   events (notes, program and volume changes). Within a segment a bend is dropped
+   while the held value stays within PB_MaxErr cents of it, since a receiver holds
+   the last bend rather than interpolating. The last bend of a segment is always
+   kept so the pitch settles on the value the driver wrote. With -pb_err the
+   error bound is hard: a bend closer than PB_MinTicks to the previous kept bend
+   is still kept when dropping it would exceed PB_MaxErr, and only counted.
+   Without -pb_err, bends closer than PB_MinTicks are dropped whatever their
+   error. */
+static double BendCents(int pb1, int pb2) {
+    /* One KF step is 64 bend units and 1/64 of a semitone */
+    return abs(pb1 - pb2) * 100.0 / 4096.0;
 }
 
-static int CompareVoice(Voice_Struct v1, Voice_Struct v2) {
-    int op;
+static void ThinPitchBends() {
+    double spt = SamplesPerTick();
+    double maxErr = 0, err;
+    double* eventTime;
+    uint8_t* lastBend;
+    double lastKept, t;
+    int bendNext[16] = { 0 };
+    int chan, i, held, value, command;
+    int total = 0, removed = 0, crowded = 0;
+
+    eventTime = (double*)malloc((size_t)(MidiEventsCount + 1) * sizeof(double));
+    lastBend = (uint8_t*)malloc((size_t)MidiEventsCount + 1);
+    if (eventTime == NULL || lastBend == NULL) {
+        fprintf(stderr, "Memory allocation failed in ThinPitchBends()\n");
+        free(eventTime);
+        free(lastBend);
+        return;
+    }
+    t = 0;
+    for (i = 0; i < MidiEventsCount; i++) {
+        t += MidiEvents[i].Delay;
+        eventTime[i] = t / spt;
+    }
+
+    /* Walking backwards, a bend is the last before the channel's next other
+       event unless the channel's next event is another bend */
+    for (i = MidiEventsCount - 1; i >= 0; i--) {
+        command = MidiEvents[i].Command;
+        if (command >= 0xF0) continue;
+        lastBend[i] = (command & 0xF0) == 0xE0 && !bendNext[command & 0xF];
+        bendNext[command & 0xF] = (command & 0xF0) == 0xE0;
+    }
+
+    for (chan = 0; chan < 8; chan++) {
+        held = 8192;            // main() centres every channel before parsing
+        lastKept = -1e9;
+        for (i = 0; i < MidiEventsCount; i++) {
+            if (MidiEvents[i].Command != 0xE0 + chan) continue;
+            total++;
+            value = MidiEvents[i].Param1 | (MidiEvents[i].Param2 << 7);
+
+            err = BendCents(value, held);
+            if (err == 0 || (!lastBend[i] && err <= PB_MaxErr) ||
+                (!lastBend[i] && PB_MaxErr <= 0 && eventTime[i] - lastKept < PB_MinTicks)) {
+                MidiEvents[i].Keep = 0;
+                removed++;
+                if (err > maxErr) maxErr = err;
+            }
+            else {
+                if (eventTime[i] - lastKept < PB_MinTicks) crowded++;
+                held = value;
+                lastKept = eventTime[i];
+            }
+        }
+    }
+    free(eventTime);
+    free(lastBend);
+
+    Info("Pitch bends removed: %d of %d\n", removed, total);
+    if (PB_MaxErr > 0)
+        Info("Pitch bend error: %.2f cents maximum, %.2f cents allowed\n", maxErr, PB_MaxErr);
+    else
+        Info("Pitch bend error: %.2f cents maximum, no limit without -pb_err\n", maxErr);
+    if (crowded > 0)
+        Info("Pitch bends kept closer than -pb_min: %d\n", crowded);
+}
+
+/* A dropped event passes on the whole ticks it would have had, rounded the
+   same way Send_Midi() rounds, so every kept event lands on the tick it would
+   have had without thinning */
+static void FlushMidiEvents() {
+    double spt = SamplesPerTick();
+    int i, carry = 0, trailing = delay_val;
+
+    MidiDeferred = 0;
+    for (i = 0; i < MidiEventsCount; i++) {
+        if (MidiEvents[i].Keep) {
+            delay_val = MidiEvents[i].Delay;
+            delay_ticks = carry;
+            if (MidiEvents[i].Command == 0xFF && MidiEvents[i].Param1 == 0x01)
+                Send_VoiceText(MidiEvents[i].Param2);
+            else
+                Send_Midi(MidiEvents[i].Command, MidiEvents[i].Param1, MidiEvents[i].Param2);
+            carry = 0;
+        }
+        else {
+            carry += (int)(MidiEvents[i].Delay / spt);
+        }
+    }
+    delay_val = trailing;
+    delay_ticks = carry;
+    MidiEventsCount = 0;
+}
+
+static void AddVoice(Voice_Struct v) {
+    if (VoicesCount == VoicesCapacity) {
+        int newCapacity = VoicesCapacity ? VoicesCapacity * 2 : 64;
+        Voice_Struct* temp = (Voice_Struct*)realloc(Voices, (size_t)newCapacity * sizeof(Voice_Struct));
+        if (temp == NULL) {
+            fprintf(stderr, "Memory allocation failed in AddVoice()\n");
+            return;
+        }
+        Voices = temp;
+        VoicesCapacity = newCapacity;
+    }
+
+    Voices[VoicesCount] = v;
+    VoicesCount++;
+}
+
+static int CompareVoice(Voice_Struct v1, Voice_Struct v2) {
+    int op;
     if (v1.LFRQ != v2.LFRQ) return 0;
     if (v1.AMD != v2.AMD) return 0;
     if (v1.PMD != v2.PMD) return 0;
@@ -241,18 +1351,18 @@ static int FindVoice(Voice_Struct v) {
 }
 
 /* --- Get current voice from register values --- */
-static CurrVoice_Struct GetCurrentVoice(int chan) {
+static CurrVoice_Struct VoiceFromRegisters(const uint8_t* regs, int amd, int pmd, int chan) {
     int op, TL_Min;
     CurrVoice_Struct curr_voice = {0};
     curr_voice.Voice.Name[0] = '\0';
 
-    curr_voice.Voice.AMS = Registers[0x38 + chan] & 3;
-    curr_voice.Voice.PMS = (Registers[0x38 + chan] >> 4) & 7;
+    curr_voice.Voice.AMS = regs[0x38 + chan] & 3;
+    curr_voice.Voice.PMS = (regs[0x38 + chan] >> 4) & 7;
 
     if (curr_voice.Voice.AMS != 0 || curr_voice.Voice.PMS != 0) {
-        curr_voice.Voice.LFRQ = Registers[0x18];
-        curr_voice.Voice.AMD = AMD_val;
-        curr_voice.Voice.PMD = PMD_val;
+        curr_voice.Voice.LFRQ = regs[0x18];
+        curr_voice.Voice.AMD = amd;
+        curr_voice.Voice.PMD = pmd;
     }
     else {
         curr_voice.Voice.LFRQ = 0;
@@ -260,26 +1370,26 @@ static CurrVoice_Struct GetCurrentVoice(int chan) {
         curr_voice.Voice.PMD = 0;
     }
 
-    curr_voice.Voice.WF = Registers[0x1B] & 3;
-    curr_voice.Voice.NFRQ = Registers[0x0F] & 127;
-    curr_voice.Voice.PAN = Registers[0x20 + chan] & 192;
-    curr_voice.Voice.FL = (Registers[0x20 + chan] >> 3) & 7;
-    curr_voice.Voice.CON = Registers[0x20 + chan] & 7;
-    curr_voice.Voice.SLOT = Registers[0x8] & 120;
-    curr_voice.Voice.NE = Registers[0x0F] & 128;
+    curr_voice.Voice.WF = regs[0x1B] & 3;
+    curr_voice.Voice.NFRQ = regs[0x0F] & 127;
+    curr_voice.Voice.PAN = regs[0x20 + chan] & 192;
+    curr_voice.Voice.FL = (regs[0x20 + chan] >> 3) & 7;
+    curr_voice.Voice.CON = regs[0x20 + chan] & 7;
+    curr_voice.Voice.SLOT = regs[0x8] & 120;
+    curr_voice.Voice.NE = regs[0x0F] & 128;
 
     for (op = 0; op < 4; op++) {
-        curr_voice.Voice.Op[op].AR = Registers[0x80 + chan + (op * 8)] & 31;
-        curr_voice.Voice.Op[op].D1R = Registers[0xA0 + chan + (op * 8)] & 31;
-        curr_voice.Voice.Op[op].D2R = Registers[0xC0 + chan + (op * 8)] & 31;
-        curr_voice.Voice.Op[op].RR = Registers[0xE0 + chan + (op * 8)] & 15;
-        curr_voice.Voice.Op[op].D1L = (Registers[0xE0 + chan + (op * 8)] >> 4) & 15;
-        curr_voice.Voice.Op[op].TL = Registers[0x60 + chan + (op * 8)] & 127;
-        curr_voice.Voice.Op[op].KS = (Registers[0x80 + chan + (op * 8)] >> 6) & 3;
-        curr_voice.Voice.Op[op].MUL = Registers[0x40 + chan + (op * 8)] & 15;
-        curr_voice.Voice.Op[op].DT1 = (Registers[0x40 + chan + (op * 8)] >> 4) & 7;
-        curr_voice.Voice.Op[op].DT2 = (Registers[0xC0 + chan + (op * 8)] >> 6) & 3;
-        curr_voice.Voice.Op[op].AME = Registers[0xA0 + chan + (op * 8)] & 128;
+        curr_voice.Voice.Op[op].AR = regs[0x80 + chan + (op * 8)] & 31;
+        curr_voice.Voice.Op[op].D1R = regs[0xA0 + chan + (op * 8)] & 31;
+        curr_voice.Voice.Op[op].D2R = regs[0xC0 + chan + (op * 8)] & 31;
+        curr_voice.Voice.Op[op].RR = regs[0xE0 + chan + (op * 8)] & 15;
+        curr_voice.Voice.Op[op].D1L = (regs[0xE0 + chan + (op * 8)] >> 4) & 15;
+        curr_voice.Voice.Op[op].TL = regs[0x60 + chan + (op * 8)] & 127;
+        curr_voice.Voice.Op[op].KS = (regs[0x80 + chan + (op * 8)] >> 6) & 3;
+        curr_voice.Voice.Op[op].MUL = regs[0x40 + chan + (op * 8)] & 15;
+        curr_voice.Voice.Op[op].DT1 = (regs[0x40 + chan + (op * 8)] >> 4) & 7;
+        curr_voice.Voice.Op[op].DT2 = (regs[0xC0 + chan + (op * 8)] >> 6) & 3;
+        curr_voice.Voice.Op[op].AME = regs[0xA0 + chan + (op * 8)] & 128;
     }
 
     TL_Min = 255;
@@ -306,12 +1416,603 @@ static CurrVoice_Struct GetCurrentVoice(int chan) {
     return curr_voice;
 }
 
+static CurrVoice_Struct GetCurrentVoice(int chan) {
+    return VoiceFromRegisters(Registers, AMD_val, PMD_val, chan);
+}
+
+/* --- General MIDI program mapping ---
+   Each discovered voice is matched to the nearest reference voice, and the
+   reference's GM program is sent instead of the discovery order. Voices are
+   compared on a normalised feature vector (feedback, then per operator: carrier
+   flag, rates, sustain level, modulator TL, multiplier and DT2), and the
+   reference voices are kept in a vantage-point tree so each lookup visits only
+   a few of them. The reference library is an OPM file given with -gm_lib whose
+   "@:n" numbers are GM programs (0-127); there is no built-in one, since a
+   hand-made set covers too few programs to give a meaningful mapping. */
+static void NormaliseCarrierTL(Voice_Struct* v) {
+    int op, TL_Min = 255;
+
+    for (op = 0; op < 4; op++) {
+        if (Carrier(v->CON, op) && v->Op[op].TL < TL_Min) TL_Min = v->Op[op].TL;
+    }
+    for (op = 0; op < 4; op++) {
+        if (Carrier(v->CON, op)) v->Op[op].TL -= TL_Min;
+    }
+}
+
+static void VoiceFeatures(const Voice_Struct* v, double* f) {
+    int op, n = 0, car;
+
+    f[n++] = v->FL / 7.0;
+    for (op = 0; op < 4; op++) {
+        car = Carrier(v->CON, op);
+        f[n++] = car * 1.5;                 // the algorithm matters more than any one rate
+        f[n++] = v->Op[op].AR / 31.0;
+        f[n++] = v->Op[op].D1R / 31.0;
+        f[n++] = v->Op[op].D2R / 31.0;
+        f[n++] = v->Op[op].RR / 15.0;
+        f[n++] = v->Op[op].D1L / 15.0;
+        f[n++] = (car ? v->Op[op].TL : 127 - v->Op[op].TL) / 127.0;    // modulation depth
+        f[n++] = v->Op[op].MUL / 15.0;
+        f[n++] = v->Op[op].DT2 / 3.0;
+    }
+}
+
+static double FeatureDistance(const double* a, const double* b) {
+    double sum = 0, diff;
+    int i;
+
+    for (i = 0; i < GM_FEATURES; i++) {
+        diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sqrt(sum);
+}
+
+static void AddGMVoice(const Voice_Struct* v, int program) {
+    GMVoice_Struct* temp = (GMVoice_Struct*)realloc(GMLibrary, ((size_t)GMLibraryCount + 1) * sizeof(GMVoice_Struct));
+    if (temp == NULL) {
+        fprintf(stderr, "Memory allocation failed in AddGMVoice()\n");
+        return;
+    }
+    GMLibrary = temp;
+    GMLibrary[GMLibraryCount].Voice = *v;
+    GMLibrary[GMLibraryCount].Program = program & 127;
+    NormaliseCarrierTL(&GMLibrary[GMLibraryCount].Voice);
+    VoiceFeatures(&GMLibrary[GMLibraryCount].Voice, GMLibrary[GMLibraryCount].Features);
+    GMLibraryCount++;
+}
+
+/* Read "@:n name" voices in the layout WriteInsts() produces */
+static int LoadGMLibrary(const char* path) {
+    FILE* f = NULL;
+    char line[256];
+    Voice_Struct v;
+    int program = -1, op, n, vals[11];
+
+    if (fopen_s(&f, path, "r") != 0 || f == NULL) return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "@:", 2) == 0) {
+            if (program >= 0) AddGMVoice(&v, program);
+            memset(&v, 0, sizeof(v));
+            program = atoi(line + 2);
+            n = 2;
+            while (line[n] >= '0' && line[n] <= '9') n++;
+            while (line[n] == ' ' || line[n] == '\t') n++;
+            strncpy_s(v.Name, sizeof(v.Name), line + n, _TRUNCATE);
+            v.Name[strcspn(v.Name, "\r\n")] = '\0';
+        }
+        else if (program < 0) {
+            continue;
+        }
+        else if (strncmp(line, "LFO:", 4) == 0) {
+            sscanf_s(line + 4, "%d %d %d %d %d", &v.LFRQ, &v.AMD, &v.PMD, &v.WF, &v.NFRQ);
+        }
+        else if (strncmp(line, "CH:", 3) == 0) {
+            sscanf_s(line + 3, "%d %d %d %d %d %d %d", &v.PAN, &v.FL, &v.CON, &v.AMS, &v.PMS, &v.SLOT, &v.NE);
+        }
+        else if (line[0] != '\0' && (line[0] == 'M' || line[0] == 'C') && (line[1] == '1' || line[1] == '2') && line[2] == ':') {
+            if (sscanf_s(line + 3, "%d %d %d %d %d %d %d %d %d %d %d", &vals[0], &vals[1], &vals[2], &vals[3], &vals[4],
+                &vals[5], &vals[6], &vals[7], &vals[8], &vals[9], &vals[10]) != 11) continue;
+            /* OPM lists M1 C1 M2 C2; Op[] is in register order M1 M2 C1 C2 */
+            op = (line[0] == 'M' ? 0 : 2) + (line[1] == '2' ? 1 : 0);
+            v.Op[op].AR = vals[0];
+            v.Op[op].D1R = vals[1];
+            v.Op[op].D2R = vals[2];
+            v.Op[op].RR = vals[3];
+            v.Op[op].D1L = vals[4];
+            v.Op[op].TL = vals[5];
+            v.Op[op].KS = vals[6];
+            v.Op[op].MUL = vals[7];
+            v.Op[op].DT1 = vals[8];
+            v.Op[op].DT2 = vals[9];
+            v.Op[op].AME = vals[10];
+        }
+    }
+    if (program >= 0) AddGMVoice(&v, program);
+    fclose(f);
+    return GMLibraryCount > 0;
+}
+
+typedef struct {
+    int Item;
+    double Distance;
+} VPItem_Struct;
+
+static int CompareVPItem(const void* a, const void* b) {
+    double d = ((const VPItem_Struct*)a)->Distance - ((const VPItem_Struct*)b)->Distance;
+    return (d > 0) - (d < 0);
+}
+
+/* Build the subtree for items[0..count), returning its node index */
+static int BuildVPTree(VPItem_Struct* items, int count) {
+    int node, i, median;
+    const double* vantage;
+
+    if (count == 0) return -1;
+    node = GMTreeCount++;
+    GMTree[node].Item = items[0].Item;
+    GMTree[node].Radius = 0;
+    GMTree[node].Inside = GMTree[node].Outside = -1;
+    if (count == 1) return node;
+
+    vantage = GMLibrary[items[0].Item].Features;
+    for (i = 1; i < count; i++) {
+        items[i].Distance = FeatureDistance(vantage, GMLibrary[items[i].Item].Features);
+    }
+    qsort(items + 1, count - 1, sizeof(VPItem_Struct), CompareVPItem);
+    median = 1 + (count - 1) / 2;
+    GMTree[node].Radius = items[median].Distance;
+    GMTree[node].Inside = BuildVPTree(items + 1, median - 1);
+    GMTree[node].Outside = BuildVPTree(items + median, count - median);
+    return node;
+}
+
+static void SearchVPTree(int node, const double* target, int* best, double* bestDist) {
+    double dist;
+
+    if (node < 0) return;
+    dist = FeatureDistance(target, GMLibrary[GMTree[node].Item].Features);
+    if (dist < *bestDist) {
+        *bestDist = dist;
+        *best = GMTree[node].Item;
+    }
+    if (dist < GMTree[node].Radius) {
+        SearchVPTree(GMTree[node].Inside, target, best, bestDist);
+        if (dist + *bestDist >= GMTree[node].Radius)
+            SearchVPTree(GMTree[node].Outside, target, best, bestDist);
+    }
+    else {
+        SearchVPTree(GMTree[node].Outside, target, best, bestDist);
+        if (dist - *bestDist <= GMTree[node].Radius)
+            SearchVPTree(GMTree[node].Inside, target, best, bestDist);
+    }
+}
+
+static int InitGMMap(const char* libraryPath) {
+    VPItem_Struct* items;
+    int i;
+
+    if (libraryPath[0] == '\0') {
+        printf("-gm needs a reference voice library: give an OPM file with -gm_lib\n");
+        return 0;
+    }
+    if (!LoadGMLibrary(libraryPath)) {
+        printf("Cannot load GM voice library %s\n", libraryPath);
+        return 0;
+    }
+
+    items = (VPItem_Struct*)malloc((size_t)GMLibraryCount * sizeof(VPItem_Struct));
+    GMTree = (VPNode_Struct*)malloc((size_t)GMLibraryCount * sizeof(VPNode_Struct));
+    if (items == NULL || GMTree == NULL) {
+        free(items);
+        return 0;
+    }
+    for (i = 0; i < GMLibraryCount; i++) items[i].Item = i;
+    GMTreeCount = 0;
+    GMRoot = BuildVPTree(items, GMLibraryCount);
+    free(items);
+    return 1;
+}
+
+/* GM program for entry id of Voices, matching any voices found since the last call */
+static int GMProgram(int id) {
+    double features[GM_FEATURES];
+    int best;
+
+    while (GMProgramsCount <= id && GMProgramsCount < VoicesCount) {
+        int* temp = (int*)realloc(GMPrograms, ((size_t)GMProgramsCount + 1) * sizeof(int));
+        double* tempDist = (double*)realloc(GMDistances, ((size_t)GMProgramsCount + 1) * sizeof(double));
+        if (temp != NULL) GMPrograms = temp;
+        if (tempDist != NULL) GMDistances = tempDist;
+        if (temp == NULL || tempDist == NULL) {
+            fprintf(stderr, "Memory allocation failed in GMProgram()\n");
+            return id & 127;
+        }
+        VoiceFeatures(&Voices[GMProgramsCount], features);
+        best = 0;
+        GMDistances[GMProgramsCount] = 1e30;
+        SearchVPTree(GMRoot, features, &best, &GMDistances[GMProgramsCount]);
+        GMPrograms[GMProgramsCount] = best;
+        GMProgramsCount++;
+    }
+    return GMLibrary[GMPrograms[id]].Program;
+}
+
+static void ReportGMMap() {
+    int i;
+
+    for (i = 0; i < GMProgramsCount; i++) {
+        Info("Voice %d mapped to GM program %d (%s), distance %.3f\n", i,
+            GMLibrary[GMPrograms[i]].Program + 1, GMLibrary[GMPrograms[i]].Voice.Name, GMDistances[i]);
+    }
+    GMProgramsCount = 0;
+}
+
+static void FreeGMMap() {
+    free(GMLibrary);
+    free(GMTree);
+    GMLibrary = NULL;
+    GMTree = NULL;
+    GMLibraryCount = GMTreeCount = 0;
+}
+
+/* --- Envelope generator model ---
+   A lightweight YM2151 EG for all 32 operators, used to give note-ons a velocity
+   and, with -expr, to follow the carrier envelope with CC11. Attenuation moves
+   linearly at the chip's average rate for each phase (the exponential attack
+   is replaced by a linear ramp of the same length, about 73 increments from
+   silence), so a whole wait is one clamped multiply-add per
+   operator, done four operators at a time with SSE2 when available. Only
+   operators that reach the end of their phase are revisited one by one. The
+   cost is therefore fixed per wait command, whatever its length, plus the
+   short stretch at the start of each note that is stepped finely to measure
+   its velocity. */
+enum { EG_ATTACK, EG_DECAY1, EG_DECAY2, EG_RELEASE };
+
+/* Average attenuation steps per EG tick for effective rate 0-63. The chip's
+   increment table gives 4-7 increments per 8 table steps, and the table advances
+   every 2^(11 - rate/4) ticks below rate 48 and every tick above, doubling the
+   increments per rate group; rates 60-63 all add 8 every tick. */
+static float EGRateSteps(int rate) {
+    if (rate <= 0) return 0;
+    if (rate >= 60) return 8;
+    return (float)((4 + (rate & 3)) / 8.0 * pow(2.0, rate / 4 - 11));
+}
+
+static void EGSetPhase(int i, int phase) {
+    int chan = i & 7, op = i >> 3;
+    int base = chan + op * 8;
+    int ks = (Registers[0x80 + base] >> 6) & 3;
+    int rks = ((Registers[0x28 + chan] & 0x7F) >> 2) >> (3 - ks);
+    int r, d1l;
+
+    EG_Phase[i] = phase;
+    EG_AttackEnd[i] = (phase == EG_ATTACK) ? 0 : -1;
+    EG_DecayEnd[i] = EG_MAX + 1;
+    if (phase == EG_ATTACK) {
+        r = Registers[0x80 + base] & 31;
+        if (r == 0) {
+            EG_Slope[i] = 0;
+        }
+        else if (2 * r + rks >= 62) {
+            EG_Slope[i] = -EG_MAX;
+            EG_Level[i] = 0;            // rates 62 and 63 attack instantly
+        }
+        else {
+            EG_Slope[i] = -EG_ATTACK_STEPS * EGRateSteps(2 * r + rks);
+        }
+        EG_Low[i] = 0;
+        EG_High[i] = EG_MAX;
+        return;
+    }
+    if (phase == EG_DECAY1) {
+        r = Registers[0xA0 + base] & 31;
+        d1l = (Registers[0xE0 + base] >> 4) & 15;
+        EG_High[i] = (d1l == 15) ? 31 * 32.0f : d1l * 32.0f;     // 3 dB steps, 15 is 93 dB
+        EG_DecayEnd[i] = EG_High[i];
+    }
+    else if (phase == EG_DECAY2) {
+        r = Registers[0xC0 + base] & 31;
+        EG_High[i] = EG_MAX;
+    }
+    else {
+        r = (Registers[0xE0 + base] & 15) * 2 + 1;     // RR is 4 bits
+        EG_High[i] = EG_MAX;
+    }
+    EG_Slope[i] = r ? EGRateSteps(2 * r + rks) : 0;
+    EG_Low[i] = 0;
+}
+
+static void EGReset() {
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        EG_Level[i] = EG_MAX;
+        EG_Slope[i] = 0;
+        EG_Low[i] = 0;
+        EG_High[i] = EG_MAX;
+        EG_Phase[i] = EG_RELEASE;
+        EG_AttackEnd[i] = -1;
+        EG_DecayEnd[i] = EG_MAX + 1;
+    }
+    EG_TicksPerSample = (float)(YMClock / 192.0 / 44100.0);
+    for (i = 0; i < 8; i++) {
+        EG_Dirty[i] = 0;
+        Expression_old[i] = 127;
+        EG_Velocity[i] = 127;
+        EG_Pending[i] = 0;
+    }
+    EG_PendingCount = 0;
+    EG_Owed = 0;
+    EGTime = 0;
+    EGBatches = 0;
+}
+
+/* Advance every operator by the given number of samples */
+static void EGStep(int samples) {
+    float ticks = samples * EG_TicksPerSample;
+    float before[32];
+    float t, bound;
+    unsigned ended, group;
+    int i, chan;
+
+    for (chan = 0; chan < 8; chan++) {
+        if (EG_Dirty[chan]) {
+            for (i = chan; i < 32; i += 8) EGSetPhase(i, EG_Phase[i]);
+            EG_Dirty[chan] = 0;
+        }
+    }
+
+    memcpy(before, EG_Level, sizeof(before));
+    /* Each bit of ended is an operator that finished attack or first decay */
+    ended = 0;
+#ifdef HAVE_SSE2
+    {
+        __m128 n = _mm_set1_ps(ticks);
+        for (i = 0; i < 32; i += 4) {
+            __m128 level = _mm_add_ps(_mm_loadu_ps(EG_Level + i), _mm_mul_ps(_mm_loadu_ps(EG_Slope + i), n));
+            level = _mm_min_ps(_mm_max_ps(level, _mm_loadu_ps(EG_Low + i)), _mm_loadu_ps(EG_High + i));
+            _mm_storeu_ps(EG_Level + i, level);
+            group = (unsigned)_mm_movemask_ps(_mm_or_ps(_mm_cmple_ps(level, _mm_loadu_ps(EG_AttackEnd + i)),
+                _mm_cmpge_ps(level, _mm_loadu_ps(EG_DecayEnd + i))));
+            ended |= group << i;
+        }
+    }
+#else
+    for (i = 0; i < 32; i++) {
+        float level = EG_Level[i] + EG_Slope[i] * ticks;
+        if (level < EG_Low[i]) level = EG_Low[i];
+        if (level > EG_High[i]) level = EG_High[i];
+        EG_Level[i] = level;
+        group = level <= EG_AttackEnd[i] || level >= EG_DecayEnd[i];
+        ended |= group << i;
+    }
+#endif
+
+    /* Those operators carry on into the next phase */
+    for (i = 0; ended != 0; i++, ended >>= 1) {
+        if (!(ended & 1)) continue;
+        t = ticks;
+        while ((EG_Phase[i] == EG_ATTACK && EG_Level[i] <= 0) ||
+            (EG_Phase[i] == EG_DECAY1 && EG_Level[i] >= EG_High[i])) {
+            if (EG_Phase[i] == EG_ATTACK) EG_Topped[i] = 1;
+            bound = (EG_Phase[i] == EG_ATTACK) ? 0 : EG_High[i];
+            if (EG_Slope[i] != 0) t -= (bound - before[i]) / EG_Slope[i];
+            if (t < 0) t = 0;
+            EGSetPhase(i, EG_Phase[i] + 1);
+            before[i] = bound;
+            EG_Level[i] = bound + EG_Slope[i] * t;
+            if (EG_Level[i] > EG_High[i]) EG_Level[i] = EG_High[i];
+            if (EG_Level[i] < EG_Low[i]) EG_Level[i] = EG_Low[i];
+        }
+    }
+    EGBatches++;
+}
+
+/* Loudest carrier attenuation of a channel */
+static float EGCarrierLevel(int chan) {
+    float best = EG_MAX;
+    int op, i, con = Registers[0x20 + chan] & 7;
+
+    for (op = 0; op < 4; op++) {
+        if (!Carrier(con, op)) continue;
+        i = chan + op * 8;
+        if (EG_Level[i] < best) best = EG_Level[i];
+    }
+    return best;
+}
+
+/* MIDI value for an attenuation, on the same curve as the CC7 volume */
+static int EGMidiValue(float level) {
+    double v = pow(10, -(level * 0.09375) / 40.0) * 127;
+    if (v > 127) v = 127;
+    return (int)v;
+}
+
+/* --- Note velocity from the envelope ---
+   With -eg a note's velocity is the carrier's mean level over its first
+   EG_WINDOW seconds, or over the time it is held if it is released sooner, so
+   slow attacks, fast decays and staccato notes cut off in their attack all
+   come out softer than a held note at full level. With -expr the decay is
+   carried by CC11 instead, so the velocity is the loudest level the carrier
+   reaches while the key is held and CC11 never has to go above 127. Either
+   level is only known once the note has got that far, so while a velocity is
+   measured every MIDI event is queued (MidiDeferred) and the note-on goes out
+   with 127; QueueMidi() chains the note's note-ons and CC11s, and
+   EGEndVelocity() then patches the note-ons and scales the CC11 values,
+   which were relative to 127, to the real velocity. For the mean the model
+   steps in EG_WINDOW_STEP samples during the window, so the extra cost is at
+   most EG_WINDOW * 44100 / EG_WINDOW_STEP steps per note. */
+static void EGEndVelocity(int chan) {
+    int v, i;
+
+    if (EGExpression)
+        v = EG_Peak[chan];
+    else
+        v = (int)(EG_Held[chan] > 0 ? EG_Sum[chan] / EG_Held[chan] : EG_Last[chan]);
+    if (v < 1) v = 1;
+    if (v > 127) v = 127;
+    for (i = EG_PendingLast[chan]; i >= 0; i = MidiEvents[i].Previous) {
+        if (MidiEvents[i].Command == 0x90 + chan)
+            MidiEvents[i].Param2 = v;
+        else
+            MidiEvents[i].Param2 = MidiEvents[i].Param2 * 127 / v > 127 ? 127 : MidiEvents[i].Param2 * 127 / v;
+    }
+    Expression_old[chan] = Expression_old[chan] * 127 / v > 127 ? 127 : Expression_old[chan] * 127 / v;
+    EG_Velocity[chan] = v;
+    EG_Pending[chan] = 0;
+    EG_PendingCount--;
+
+    /* Without pitch-bend thinning nothing else needs the queue */
+    if (EG_PendingCount == 0 && PB_MaxErr <= 0 && PB_MinTicks <= 0) {
+        FlushMidiEvents();
+        MidiDeferred = 1;
+    }
+}
+
+/* Called at a note-on, after the key-on has been applied to the model and
+   before any of the note's events are sent */
+static void EGStartVelocity(int chan) {
+    int op;
+
+    if (EG_Pending[chan]) EGEndVelocity(chan);
+    EG_Pending[chan] = 1;
+    EG_PendingLast[chan] = -1;
+    EG_PendingCount++;
+    EG_Sum[chan] = 0;
+    EG_Held[chan] = 0;
+    EG_Last[chan] = EGMidiValue(EGCarrierLevel(chan));
+    EG_Peak[chan] = EG_Last[chan];
+    for (op = 0; op < 4; op++) EG_Topped[chan + op * 8] = 0;
+    EG_Velocity[chan] = 127;
+    Expression_old[chan] = -1;      // the old value was relative to the last note's velocity
+}
+
+/* Add the step just modelled to the measured notes */
+static void EGMeasure(int samples) {
+    double dt = samples / 44100.0;
+    int chan, op, v, con;
+
+    for (chan = 0; chan < 8; chan++) {
+        if (!EG_Pending[chan]) continue;
+        v = EGMidiValue(EGCarrierLevel(chan));
+        if (EGExpression) {
+            /* A carrier that topped out inside the step passed full level */
+            con = Registers[0x20 + chan] & 7;
+            for (op = 0; op < 4; op++) {
+                if (EG_Topped[chan + op * 8] && Carrier(con, op)) v = 127;
+                EG_Topped[chan + op * 8] = 0;
+            }
+            if (v > EG_Peak[chan]) EG_Peak[chan] = v;
+            continue;
+        }
+        EG_Sum[chan] += (EG_Last[chan] + v) * 0.5 * dt;
+        EG_Held[chan] += dt;
+        EG_Last[chan] = v;
+        if (EG_Held[chan] >= EG_WINDOW) EGEndVelocity(chan);
+    }
+}
+
+/* Advance the model over a wait, in small steps while a mean is measured */
+static void EGAdvance(int samples) {
+    int step;
+
+    while (samples > 0) {
+        step = samples;
+        if (EG_PendingCount > 0 && !EGExpression && step > EG_WINDOW_STEP) step = EG_WINDOW_STEP;
+        EGStep(step);
+        if (EG_PendingCount > 0) EGMeasure(step);
+        samples -= step;
+    }
+}
+
+/* Model the samples owed since the last step. Without a mean being measured
+   or -expr, no level is needed between key and rate changes, and one step
+   over any length is exact, so waits only add to EG_Owed. */
+static void EGCatchUp() {
+    double start;
+
+    if (EG_Owed == 0) return;
+    start = NowSeconds();
+    EGAdvance(EG_Owed);
+    EG_Owed = 0;
+    EGTime += NowSeconds() - start;
+}
+
+/* Track key-on bits and the registers that change an operator's rates */
+static void EGRegister(int reg, int val) {
+    static const int slotOp[4] = { 0, 2, 1, 3 };    // key-on bits are M1 C1 M2 C2
+    int chan, bit, i, on;
+
+    if (reg == 0x08) {
+        EGCatchUp();
+        chan = val & 7;
+        for (bit = 0; bit < 4; bit++) {
+            i = chan + slotOp[bit] * 8;
+            on = (val >> (3 + bit)) & 1;
+            if (on && EG_Phase[i] == EG_RELEASE)
+                EGSetPhase(i, EG_ATTACK);
+            else if (!on && EG_Phase[i] != EG_RELEASE)
+                EGSetPhase(i, EG_RELEASE);
+        }
+    }
+    else if ((reg >= 0x28 && reg <= 0x2F) || reg >= 0x80) {
+        EGCatchUp();
+        EG_Dirty[reg & 7] = 1;
+    }
+}
+
+/* Settle every note still measured, at key-off or the end of the file */
+static void EGEndVelocities() {
+    int chan;
+
+    for (chan = 0; chan < 8; chan++)
+        if (EG_Pending[chan]) EGEndVelocity(chan);
+}
+
+/* CC11 for the carrier's current level relative to the note's velocity */
+static int ExpressionValue(int chan) {
+    int v = EGMidiValue(EGCarrierLevel(chan)) * 127 / EG_Velocity[chan];
+    return v > 127 ? 127 : v;
+}
+
+/* Sent before each note-on, so the note starts from its own envelope rather
+   than the previous note's CC11 */
+static void StartExpression(int chan) {
+    int v = ExpressionValue(chan);
+
+    if (v != Expression_old[chan]) {
+        Send_Midi(0xB0 + chan, 11, v);
+        Expression_old[chan] = v;
+    }
+}
+
+/* CC11 follows the carrier envelope through attack, decay and sustain while the
+   note is held */
+static void UpdateExpression() {
+    int chan, v;
+
+    for (chan = 0; chan < 8; chan++) {
+        if (!NoteOn[chan]) continue;
+        v = ExpressionValue(chan);
+        if (abs(v - Expression_old[chan]) >= 2 ||
+            (v != Expression_old[chan] && (v == 0 || v == 127))) {
+            Send_Midi(0xB0 + chan, 11, v);
+            Expression_old[chan] = v;
+        }
+    }
+}
+
 /* --- Send YM register commands --- */
 static void SendYM() {
     int KF_PB, Chan;
     double Vol;
+    int discovered;
 
     Registers[ym_reg] = ym_val;
+    if (out_file_trace) FrameWrites++;
+    if (EGModel) EGRegister(ym_reg, ym_val);
 
     if (ym_reg == 0x8) {
         Chan = ym_val & 0x7;
@@ -321,9 +2022,17 @@ static void SendYM() {
             VolumeChangeAmount_old[Chan] = CurrentVoice[Chan].VolumeChangeAmount;
             CurrentVoice[Chan] = GetCurrentVoice(Chan);
             VoiceID_old[Chan] = VoiceID[Chan];
+            discovered = VoicesCount;
             VoiceID[Chan] = FindVoice(CurrentVoice[Chan].Voice);
             if (VoiceID_old[Chan] != VoiceID[Chan]) {
-                Send_Midi(0xC0 + Chan, VoiceID[Chan], -1);
+                if (GMMap) {
+                    Send_Midi(0xC0 + Chan, GMProgram(VoiceID[Chan]), -1);
+                    Send_VoiceText(VoiceID[Chan]);
+                }
+                else {
+                    Send_Midi(0xC0 + Chan, VoiceID[Chan], -1);
+                }
+                if (out_file_trace) TraceVoice(Chan, VoiceID[Chan], VoiceID_old[Chan], VoicesCount != discovered);
             }
             if (VolumeChangeAmount_old[Chan] != CurrentVoice[Chan].VolumeChangeAmount) {
                 Vol = -(CurrentVoice[Chan].VolumeChangeAmount * 0.75);
@@ -342,14 +2051,21 @@ static void SendYM() {
         }
         if (NoteOn_Old[Chan] != NoteOn[Chan]) {
             if (NoteOn[Chan]) {
-                if (Note[Chan] >= 0)
-                    Send_Midi(0x90 + Chan, Note[Chan], 127);
+                if (Note[Chan] >= 0) {
+                    if (EGModel) EGStartVelocity(Chan);
+                    if (EGExpression) StartExpression(Chan);
+                    Send_Midi(0x90 + Chan, Note[Chan], EG_Velocity[Chan]);
+                    if (out_file_trace) TraceNoteOn(Chan, Note[Chan]);
+                }
                 else
                     printf("Key on occurred before note was set!\n");
             }
             else {
-                if (Note[Chan] >= 0)
+                if (Note[Chan] >= 0) {
                     Send_Midi(0x80 + Chan, Note[Chan], 0);
+                    if (out_file_trace) TraceNoteOff(Chan);
+                }
+                if (EG_Pending[Chan]) EGEndVelocity(Chan);
             }
         }
     }
@@ -360,7 +2076,12 @@ static void SendYM() {
         if (NoteOn[Chan] && (Note[Chan] != Note_Old[Chan])) {
             if (Note_Old[Chan] >= 0)
                 Send_Midi(0x80 + Chan, Note_Old[Chan], 0);
-            Send_Midi(0x90 + Chan, Note[Chan], 127);
+            /* A new key code does not restart the envelope, so keep the note's velocity */
+            Send_Midi(0x90 + Chan, Note[Chan], EG_Velocity[Chan]);
+            if (out_file_trace) {
+                TraceNoteOff(Chan);
+                TraceNoteOn(Chan, Note[Chan]);
+            }
         }
     }
     else if ((ym_reg >= 0x30) && (ym_reg <= 0x37)) {
@@ -370,6 +2091,7 @@ static void SendYM() {
             KF_old[Chan] = KF[Chan];
             KF_PB = KF[Chan] * 64 + 8192;
             Send_Midi(0xE0 + Chan, KF_PB & 0x7F, KF_PB >> 7);
+            if (out_file_trace) TraceKF(Chan);
         }
     }
     else if (ym_reg == 0x19) {
@@ -387,82 +2109,185 @@ static void SendYM() {
     }
 }
 
+/* --- Frame batching ---
+   With -frame, key-on, key code and key fraction writes between two waits are
+   held back and applied once per channel when the frame ends, so a driver that
+   rewrites them several times in a frame produces one set of MIDI events.
+   Other registers are stored immediately, so the voice, volume and pitch seen at
+   the end of the frame are what the held writes are applied with. A key-off
+   followed by a key-on of a sounding note is kept as a retrigger. */
+static void ApplyYM(int reg, int val) {
+    ym_reg = reg;
+    ym_val = val;
+    SendYM();
+    FrameApplied++;
+}
+
+static void ResetFrame() {
+    int chan;
+
+    for (chan = 0; chan < 8; chan++) {
+        FrameTouched[chan] = 0;
+        FrameOffSeen[chan] = 0;
+        FrameKey[chan] = -1;
+        FrameKC[chan] = -1;
+        FrameKF[chan] = -1;
+    }
+}
+
+static void BatchYM() {
+    int chan, on;
+
+    if (ym_reg == 0x08) {
+        chan = ym_val & 7;
+    }
+    else if ((ym_reg >= 0x28 && ym_reg <= 0x2F) || (ym_reg >= 0x30 && ym_reg <= 0x37)) {
+        chan = ym_reg & 7;
+    }
+    else {
+        SendYM();
+        return;
+    }
+
+    FrameBatched++;
+    if (!FrameTouched[chan]) {
+        FrameTouched[chan] = 1;
+        FrameOn[chan] = NoteOn[chan];
+    }
+    if (ym_reg == 0x08) {
+        on = (ym_val & 0x78) != 0;
+        if (FrameOn[chan] && !on) FrameOffSeen[chan] = 1;
+        FrameOn[chan] = on;
+        FrameKey[chan] = ym_val;
+    }
+    else if (ym_reg <= 0x2F) {
+        FrameKC[chan] = ym_val;
+    }
+    else {
+        FrameKF[chan] = ym_val;
+    }
+}
+
+static void FlushFrame() {
+    int chan;
+
+    for (chan = 0; chan < 8; chan++) {
+        if (!FrameTouched[chan]) continue;
+        if (FrameKey[chan] >= 0 && !FrameOn[chan]) {
+            /* Ending the note first stops a key code change sounding as a new note */
+            ApplyYM(0x08, FrameKey[chan]);
+            FrameKey[chan] = -1;
+        }
+        else if (FrameKey[chan] >= 0 && NoteOn[chan] && FrameOffSeen[chan]) {
+            ApplyYM(0x08, chan);
+        }
+        if (FrameKC[chan] >= 0) ApplyYM(0x28 + chan, FrameKC[chan]);
+        if (FrameKF[chan] >= 0) ApplyYM(0x30 + chan, FrameKF[chan]);
+        if (FrameKey[chan] >= 0) ApplyYM(0x08, FrameKey[chan]);
+    }
+    ResetFrame();
+}
+
+/* --- Advance the sample clock on a wait command --- */
+static void Wait(int samples) {
+    double start;
+
+    if (FrameBatch && samples > 0) FlushFrame();
+    delay_val += samples;
+    SampleTime += samples;
+    if (out_file_trace && samples > 0) TraceFrame();
+    if (EGModel && samples > 0) {
+        EG_Owed += samples;
+        if (EG_PendingCount > 0 || EGExpression) EGCatchUp();
+        if (EGExpression) {
+            start = NowSeconds();
+            UpdateExpression();
+            EGTime += NowSeconds() - start;
+        }
+    }
+}
+
 /* --- Parse one command from input file --- */
 static void Parse() {
-    if (fread(d, 1, 1, in_file) != 1) return;
+    if (ReadIn(d, 1) != 1) return;
     if (Debug) printf("Filepos: 0x%x, Register: 0x%x, Total length: 0x%x\n", filepos, d[0], filelength);
     filepos++;
 
     if (((d[0] >= 0x30) && (d[0] <= 0x3F)) || (d[0] == 0x4F) || (d[0] == 0x50)) {
-        fread(d, 1, 1, in_file); filepos++;
+        ReadIn(d, 1); filepos++;
     }
     else if (((d[0] >= 0x40) && (d[0] <= 0x4E)) ||
         ((d[0] >= 0x51) && (d[0] <= 0x53)) ||
         ((d[0] >= 0x55) && (d[0] <= 0x5F)) ||
         ((d[0] >= 0xA0) && (d[0] <= 0xBF))) {
-        fread(d, 1, 2, in_file); filepos += 2;
+        ReadIn(d, 2); filepos += 2;
     }
     else if (((d[0] >= 0xC0) && (d[0] <= 0xDF)) || (d[0] == 0x64)) {
-        fread(d, 1, 3, in_file); filepos += 3;
+        ReadIn(d, 3); filepos += 3;
     }
     else if ((d[0] >= 0xE0) && (d[0] <= 0xEF)) {
-        fread(d, 1, 4, in_file); filepos += 4;
+        ReadIn(d, 4); filepos += 4;
     }
     else if (d[0] == 0x54) {
-        fread(d, 1, 2, in_file); filepos += 2;
+        ReadIn(d, 2); filepos += 2;
         ym_reg = d[0];
         ym_val = d[1];
-        SendYM();
+        if (FrameBatch)
+            BatchYM();
+        else
+            SendYM();
     }
     else if (d[0] == 0x61) {
-        fread(d, 1, 2, in_file); filepos += 2;
-        delay_val += BytesToInt16(d);
+        ReadIn(d, 2); filepos += 2;
+        Wait(BytesToInt16(d));
     }
     else if (d[0] == 0x62) {
-        fread(d, 1, 1, in_file); filepos++;
-        delay_val += 735;
+        ReadIn(d, 1); filepos++;
+        Wait(735);
     }
     else if (d[0] == 0x63) {
-        fread(d, 1, 1, in_file); filepos++;
-        delay_val += 882;
+        ReadIn(d, 1); filepos++;
+        Wait(882);
     }
     else if (d[0] == 0x66) {
         filepos = filelength;
     }
     else if (d[0] == 0x67) {
-        fread(d, 1, 1, in_file); filepos++;     // 0x66
-        fread(d, 1, 1, in_file); filepos++;     // tt
-        fread(d, 1, 4, in_file); filepos += 4;  // ss ss ss ss
+        ReadIn(d, 1); filepos++;     // 0x66
+        ReadIn(d, 1); filepos++;     // tt
+        int type = d[0];
+        ReadIn(d, 4); filepos += 4;  // ss ss ss ss
         uint32_t extra = BytesToInt32(d);
+        if (out_file_trace) TraceDataBlock(type, extra);
         filepos += extra;
         if (filepos < 0) filepos = filelength;
-        fseek(in_file, filepos, SEEK_SET);
+        SeekIn(filepos);
     }
     else if (d[0] == 0x68) {
-        fread(d, 1, 1, in_file); filepos++;
-        fread(d, 1, 1, in_file); filepos++;
-        fread(d, 1, 3, in_file); filepos += 3;
-        fread(d, 1, 3, in_file); filepos += 3;
-        fread(d, 1, 3, in_file); filepos += 3;
+        ReadIn(d, 1); filepos++;
+        ReadIn(d, 1); filepos++;
+        ReadIn(d, 3); filepos += 3;
+        ReadIn(d, 3); filepos += 3;
+        ReadIn(d, 3); filepos += 3;
     }
     else if ((d[0] >= 0x70) && (d[0] <= 0x8F)) {
-        delay_val += d[0] & 15;
+        Wait(d[0] & 15);
     }
     else if ((d[0] == 0x90) || (d[0] == 0x91) || (d[0] == 0x95)) {
-        fread(d, 1, 4, in_file); filepos += 4;
+        ReadIn(d, 4); filepos += 4;
     }
     else if (d[0] == 0x92) {
-        fread(d, 1, 1, in_file); filepos++;
-        fread(d, 1, 4, in_file); filepos += 4;
+        ReadIn(d, 1); filepos++;
+        ReadIn(d, 4); filepos += 4;
     }
     else if (d[0] == 0x93) {
-        fread(d, 1, 1, in_file); filepos++;
-        fread(d, 1, 4, in_file); filepos += 4;
-        fread(d, 1, 1, in_file); filepos++;
-        fread(d, 1, 4, in_file); filepos += 4;
+        ReadIn(d, 1); filepos++;
+        ReadIn(d, 4); filepos += 4;
+        ReadIn(d, 1); filepos++;
+        ReadIn(d, 4); filepos += 4;
     }
     else if (d[0] == 0x94) {
-        fread(d, 1, 1, in_file); filepos++;
+        ReadIn(d, 1); filepos++;
     }
 }
 
@@ -471,6 +2296,8 @@ static void ParseLoop() {
     while (filepos < filelength) {
         Parse();
     }
+    if (FrameBatch) FlushFrame();
+    if (Pipelined) StopReader();
     fclose(in_file);
 }
 
@@ -551,13 +2378,13 @@ static void WriteInsts(const char* basepath) {
     int frlp, frlp2, length;
     char st[128];
 
-    fputc(0xF0, out_file_syx);
-    fputc(0x43, out_file_syx);
-    fputc(0x75, out_file_syx);
-    fputc(0, out_file_syx);
-    fputc(0, out_file_syx);
-    fputc(0, out_file_syx);
-    fputc(0, out_file_syx);
+    OutByte(&OutSyx, 0xF0);
+    OutByte(&OutSyx, 0x43);
+    OutByte(&OutSyx, 0x75);
+    OutByte(&OutSyx, 0);
+    OutByte(&OutSyx, 0);
+    OutByte(&OutSyx, 0);
+    OutByte(&OutSyx, 0);
 
     memset(syx_buff, 0, sizeof(syx_buff));
     syx_buff[0] = 'O' & 0xF;
@@ -578,31 +2405,31 @@ static void WriteInsts(const char* basepath) {
     syx_buff[15] = ('k' & 0xF0) >> 4;
 
     length = (int)sizeof(syx_buff);
-    fputc((length & 0xFF00) >> 8, out_file_syx);
-    fputc(length & 0xFF, out_file_syx);
-    fwrite(syx_buff, 1, length, out_file_syx);
-    fputc(Checksum(syx_buff, length), out_file_syx);
+    OutByte(&OutSyx, (length & 0xFF00) >> 8);
+    OutByte(&OutSyx, length & 0xFF);
+    OutWrite(&OutSyx, syx_buff, length);
+    OutByte(&OutSyx, Checksum(syx_buff, length));
 
-    fprintf(out_file_opm, "// Created by ym21512midi.c\n\n");
+    OutPrintf(&OutOpm, "// Created by ym21512midi.c\n\n");
 
     for (frlp = 0; frlp < 48; frlp++) {
         if (frlp < VoicesCount) {
             /* Use secure version of snprintf */
             sprintf_s(Voices[frlp].Name, sizeof(Voices[frlp].Name), "Inst %d", frlp);
             Voice_to_FB01(Voices[frlp], fb01_voice);
-            fprintf(out_file_opm, "@:%d Inst_%d\n", frlp, frlp);
-            fprintf(out_file_opm, "//  LFRQ AMD PMD WF NFRQ\n");
-            fprintf(out_file_opm, "LFO: %d  %d  %d  %d  %d\n", Voices[frlp].LFRQ, Voices[frlp].AMD, Voices[frlp].PMD, Voices[frlp].WF, Voices[frlp].NFRQ);
-            fprintf(out_file_opm, "// PAN FL CON AMS PMS SLOT NE\n");
-            fprintf(out_file_opm, "CH: %d  %d  %d  %d  %d  %d  %d\n", 64, Voices[frlp].FL, Voices[frlp].CON, Voices[frlp].AMS, Voices[frlp].PMS, Voices[frlp].SLOT, Voices[frlp].NE);
-            fprintf(out_file_opm, "//  AR D1R D2R RR D1L  TL KS MUL DT1 DT2 AMS-EN\n");
+            OutPrintf(&OutOpm, "@:%d Inst_%d\n", frlp, frlp);
+            OutPrintf(&OutOpm, "//  LFRQ AMD PMD WF NFRQ\n");
+            OutPrintf(&OutOpm, "LFO: %d  %d  %d  %d  %d\n", Voices[frlp].LFRQ, Voices[frlp].AMD, Voices[frlp].PMD, Voices[frlp].WF, Voices[frlp].NFRQ);
+            OutPrintf(&OutOpm, "// PAN FL CON AMS PMS SLOT NE\n");
+            OutPrintf(&OutOpm, "CH: %d  %d  %d  %d  %d  %d  %d\n", 64, Voices[frlp].FL, Voices[frlp].CON, Voices[frlp].AMS, Voices[frlp].PMS, Voices[frlp].SLOT, Voices[frlp].NE);
+            OutPrintf(&OutOpm, "//  AR D1R D2R RR D1L  TL KS MUL DT1 DT2 AMS-EN\n");
             for (frlp2 = 0; frlp2 < 4; frlp2++) {
                 int opLabel;
                 if (frlp2 == 0) { opLabel = 0; strcpy_s(st, sizeof(st), "M1: "); }
                 else if (frlp2 == 1) { opLabel = 2; strcpy_s(st, sizeof(st), "C1: "); }
                 else if (frlp2 == 2) { opLabel = 1; strcpy_s(st, sizeof(st), "M2: "); }
                 else { opLabel = 3; strcpy_s(st, sizeof(st), "C2: "); }
-                fprintf(out_file_opm, "%s%d  %d  %d  %d  %d  %d  %d  %d  %d  %d  %d\n", st,
+                OutPrintf(&OutOpm, "%s%d  %d  %d  %d  %d  %d  %d  %d  %d  %d  %d\n", st,
                     Voices[frlp].Op[opLabel].AR,
                     Voices[frlp].Op[opLabel].D1R,
                     Voices[frlp].Op[opLabel].D2R,
@@ -615,7 +2442,7 @@ static void WriteInsts(const char* basepath) {
                     Voices[frlp].Op[opLabel].DT2,
                     Voices[frlp].Op[opLabel].AME);
             }
-            fprintf(out_file_opm, "\n");
+            OutPrintf(&OutOpm, "\n");
         }
         else {
             if (VoicesCount > 0)
@@ -627,24 +2454,28 @@ static void WriteInsts(const char* basepath) {
             syx_buff[frlp2 * 2 + 1] = (fb01_voice[frlp2] & 0xF0) >> 4;
         }
         length = (int)sizeof(syx_buff);
-        fputc((length & 0xFF00) >> 8, out_file_syx);
-        fputc(length & 0xFF, out_file_syx);
-        fwrite(syx_buff, 1, length, out_file_syx);
-        fputc(Checksum(syx_buff, length), out_file_syx);
+        OutByte(&OutSyx, (length & 0xFF00) >> 8);
+        OutByte(&OutSyx, length & 0xFF);
+        OutWrite(&OutSyx, syx_buff, length);
+        OutByte(&OutSyx, Checksum(syx_buff, length));
     }
-    fputc(0xF7, out_file_syx);
+    OutByte(&OutSyx, 0xF7);
 }
 
 static void WriteMIDIHeader() {
-    long currentPos = ftell(out_file_midi);
     /* The MIDI file begins with a 14-byte header and an 8-byte track header.
        Update the 4-byte track length at offset 18. */
-    fseek(out_file_midi, 18, SEEK_SET);
     uint8_t trackLength[4] = {0};
     trackLength[0] = (MIDIByteCount >> 24) & 0xFF;
     trackLength[1] = (MIDIByteCount >> 16) & 0xFF;
     trackLength[2] = (MIDIByteCount >> 8) & 0xFF;
     trackLength[3] = MIDIByteCount & 0xFF;
+    if (out_file_midi == NULL) {
+        memcpy(OutMidi.Data + 18, trackLength, 4);
+        return;
+    }
+    long currentPos = ftell(out_file_midi);
+    fseek(out_file_midi, 18, SEEK_SET);
     fwrite(trackLength, 1, 4, out_file_midi);
     fseek(out_file_midi, currentPos, SEEK_SET);
 }
@@ -683,118 +2514,1086 @@ int KeyCodeToMIDINote(int data, int adjustOctave) {
     return NoteVal;
 }
 
-static void parseArguments(int argc, char* argv[], char* inputPath) {
-    TL_Tol = 10;
-    Gain = 1.0;
-    BPM = 120;
-    TQN = 96;
-    Debug = 0;
-    inputPath[0] = '\0';
+/* --- Corpus index ---
+   "index" scans a directory tree with one worker per CPU and writes every VGM's
+   header, GD3 tags and a voice fingerprint to one index file. "query" searches
+   that file without opening the VGMs again.
 
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-d") == 0) {
-            Debug = 1;
-        }
-        else if (strcmp(argv[i], "-tl_tol") == 0 && i + 1 < argc) {
-            TL_Tol = atoi(argv[++i]);
-        }
-        else if (strcmp(argv[i], "-gain") == 0 && i + 1 < argc) {
-            Gain = atof(argv[++i]);
+   Index file layout (little endian):
+     "YMIX", version, record count, string table size
+     record count x INDEX_RECORD_SIZE byte records, sorted by path
+     string table of NUL-terminated UTF-8 strings, each stored once
+   A record is six string offsets (path, title, game, system, author, date)
+   followed by clock, version, total samples, loop samples, file size, voices
+   and the 64-bit fingerprint. */
+static void Int32ToBytes(uint32_t v, uint8_t* bytes) {
+    bytes[0] = v & 0xFF;
+    bytes[1] = (v >> 8) & 0xFF;
+    bytes[2] = (v >> 16) & 0xFF;
+    bytes[3] = (v >> 24) & 0xFF;
+}
+
+static int HasExtension(const char* name, const char* ext) {
+    size_t n = strlen(name), e = strlen(ext);
+    size_t i;
+
+    if (n < e) return 0;
+    for (i = 0; i < e; i++) {
+        char c = name[n - e + i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != ext[i]) return 0;
+    }
+    return 1;
+}
+
+static void AddIndexPath(const char* path, const char* name) {
+    (void)name;
+    if (IndexCount == IndexCapacity) {
+        int newCapacity = IndexCapacity ? IndexCapacity * 2 : 1024;
+        IndexEntry_Struct* temp = (IndexEntry_Struct*)realloc(IndexEntries, (size_t)newCapacity * sizeof(IndexEntry_Struct));
+        if (temp == NULL) {
+            fprintf(stderr, "Memory allocation failed in AddIndexPath()\n");
+            return;
         }
-        else if (strcmp(argv[i], "-bpm") == 0 && i + 1 < argc) {
-            BPM = atof(argv[++i]);
+        IndexEntries = temp;
+        IndexCapacity = newCapacity;
+    }
+    memset(&IndexEntries[IndexCount], 0, sizeof(IndexEntry_Struct));
+    strncpy_s(IndexEntries[IndexCount].Path, sizeof(IndexEntries[IndexCount].Path), path, _TRUNCATE);
+    IndexCount++;
+}
+
+/* Build dir + separator + name, returning 0 rather than using a truncated path */
+static int JoinPath(char* path, size_t size, const char* dir, const char* name) {
+    int written;
+#ifdef _WIN32
+    if (strlen(dir) + strlen(name) + 2 > size) return 0;
+    written = sprintf_s(path, size, "%s\\%s", dir, name);
+#else
+    written = sprintf_s(path, size, "%s/%s", dir, name);
+#endif
+    return written > 0 && (size_t)written < size;
+}
+
+/* Call visit for every .vgm file in dir, and in its subdirectories when recurse is set.
+   Names are relative to the first directory and always use '/'. Links to directories
+   are not followed, so a link back up the tree cannot make the walk loop, and paths
+   that would not fit the buffers are skipped rather than cut short */
+static void WalkVGMs(const char* dir, const char* rel, int recurse, void (*visit)(const char*, const char*)) {
+    char path[260];
+    char name[260];
+    const char* file;
+    int isDir, isFile;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE find;
+
+    if (!JoinPath(path, sizeof(path), dir, "*")) return;
+    find = FindFirstFileA(path, &found);
+    if (find == INVALID_HANDLE_VALUE) return;
+    do {
+        file = found.cFileName;
+        if (strcmp(file, ".") == 0 || strcmp(file, "..") == 0) continue;
+        if (!JoinPath(path, sizeof(path), dir, file)) continue;
+        isDir = (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (isDir && (found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) continue;
+        isFile = !isDir && HasExtension(file, ".vgm");
+#else
+    DIR* dp = opendir(dir);
+    struct dirent* entry;
+    struct stat st;
+
+    if (dp == NULL) return;
+    while ((entry = readdir(dp)) != NULL) {
+        file = entry->d_name;
+        if (strcmp(file, ".") == 0 || strcmp(file, "..") == 0) continue;
+        if (!JoinPath(path, sizeof(path), dir, file)) continue;
+        if (lstat(path, &st) != 0) continue;
+        isDir = S_ISDIR(st.st_mode);
+        isFile = !isDir && HasExtension(file, ".vgm") && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+        if (isDir ? !recurse : !isFile) continue;
+        if (rel[0] == '\0') strncpy_s(name, sizeof(name), file, _TRUNCATE);
+        else if (strlen(rel) + strlen(file) + 2 > sizeof(name) || sprintf_s(name, sizeof(name), "%s/%s", rel, file) < 0) continue;
+        if (isDir)
+            WalkVGMs(path, name, recurse, visit);
+        else
+            visit(path, name);
+#ifdef _WIN32
+    } while (FindNextFileA(find, &found));
+    FindClose(find);
+#else
+    }
+    closedir(dp);
+#endif
+}
+
+/* Copy a UTF-16LE GD3 string as UTF-8, returning the bytes consumed */
+static uint32_t GD3String(const uint8_t* p, uint32_t avail, char* out, size_t outSize) {
+    uint32_t pos = 0, c, c2;
+    size_t n = 0;
+
+    while (pos + 1 < avail) {
+        c = p[pos] | (p[pos + 1] << 8);
+        pos += 2;
+        if (c == 0) break;
+        /* A surrogate without its partner becomes U+FFFD; the unit after an unpaired
+           high surrogate is left to be read as a character of its own */
+        if (c >= 0xD800 && c < 0xE000) {
+            c2 = pos + 1 < avail ? (uint32_t)(p[pos] | (p[pos + 1] << 8)) : 0;
+            if (c < 0xDC00 && c2 >= 0xDC00 && c2 < 0xE000) {
+                pos += 2;
+                c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+            }
+            else
+                c = 0xFFFD;
+        }
+        if (c < 0x80 && n + 1 < outSize) {
+            out[n++] = (char)c;
+        }
+        else if (c < 0x800 && n + 2 < outSize) {
+            out[n++] = (char)(0xC0 | (c >> 6));
+            out[n++] = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000 && n + 3 < outSize) {
+            out[n++] = (char)(0xE0 | (c >> 12));
+            out[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[n++] = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c >= 0x10000 && n + 4 < outSize) {
+            out[n++] = (char)(0xF0 | (c >> 18));
+            out[n++] = (char)(0x80 | ((c >> 12) & 0x3F));
+            out[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[n++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    out[n] = '\0';
+    return pos;
+}
+
+static void ReadGD3(const uint8_t* buf, uint32_t size, IndexEntry_Struct* e) {
+    char skip[128];
+    uint32_t pos, end, len;
+
+    if (size < 0x14 + 12) return;
+    pos = (uint32_t)BytesToInt32((uint8_t*)buf + 0x14);
+    if (pos == 0 || pos > size - 0x14 - 12) return;
+    pos += 0x14;
+    if (memcmp(buf + pos, "Gd3 ", 4) != 0) return;
+    len = (uint32_t)BytesToInt32((uint8_t*)buf + pos + 8);
+    if (len > size - pos - 12) len = size - pos - 12;
+    pos += 12;
+    end = pos + len;
+
+    /* English and Japanese pairs: track, game, system, author; then date */
+    pos += GD3String(buf + pos, end - pos, e->Title, sizeof(e->Title));
+    pos += GD3String(buf + pos, end - pos, skip, sizeof(skip));
+    pos += GD3String(buf + pos, end - pos, e->Game, sizeof(e->Game));
+    pos += GD3String(buf + pos, end - pos, skip, sizeof(skip));
+    pos += GD3String(buf + pos, end - pos, e->System, sizeof(e->System));
+    pos += GD3String(buf + pos, end - pos, skip, sizeof(skip));
+    pos += GD3String(buf + pos, end - pos, e->Author, sizeof(e->Author));
+    pos += GD3String(buf + pos, end - pos, skip, sizeof(skip));
+    GD3String(buf + pos, end - pos, e->Date, sizeof(e->Date));
+}
+
+/* Length of the VGM command at p, as laid out in the VGM specification */
+static uint32_t VGMCommandLength(const uint8_t* p, uint32_t avail) {
+    uint8_t c = p[0];
+
+    if ((c >= 0x30 && c <= 0x3F) || c == 0x4F || c == 0x50 || c == 0x94) return 2;
+    if ((c >= 0x40 && c <= 0x4E) || (c >= 0x51 && c <= 0x5F) || (c >= 0xA0 && c <= 0xBF) || c == 0x61) return 3;
+    if ((c >= 0xC0 && c <= 0xDF) || c == 0x64) return 4;
+    if ((c >= 0xE0 && c <= 0xEF) || c == 0x90 || c == 0x91 || c == 0x95) return 5;
+    if (c == 0x92) return 6;
+    if (c == 0x93) return 11;
+    if (c == 0x68) return 12;
+    if (c == 0x67) {
+        uint32_t len;
+        if (avail < 7) return avail;
+        len = (uint32_t)BytesToInt32((uint8_t*)p + 3);
+        return len > avail - 7 ? 0 : 7 + len;     // 0 stops the walk at a block overrunning the file
+    }
+    return 1;
+}
+
+static uint64_t HashVoice(const Voice_Struct* v) {
+    uint64_t h = 14695981039346656037ULL;
+    int f[12 + 4 * 11];
+    int i, op, n = 0;
+
+    f[n++] = v->LFRQ; f[n++] = v->AMD; f[n++] = v->PMD; f[n++] = v->WF;
+    f[n++] = v->NFRQ; f[n++] = v->PAN; f[n++] = v->FL; f[n++] = v->CON;
+    f[n++] = v->AMS; f[n++] = v->PMS; f[n++] = v->SLOT; f[n++] = v->NE;
+    for (op = 0; op < 4; op++) {
+        f[n++] = v->Op[op].AR; f[n++] = v->Op[op].D1R; f[n++] = v->Op[op].D2R;
+        f[n++] = v->Op[op].RR; f[n++] = v->Op[op].D1L;
+        f[n++] = v->Op[op].TL >> 2;     // small TL differences are the same voice
+        f[n++] = v->Op[op].KS; f[n++] = v->Op[op].MUL; f[n++] = v->Op[op].DT1;
+        f[n++] = v->Op[op].DT2; f[n++] = v->Op[op].AME;
+    }
+    for (i = 0; i < n; i++) {
+        h ^= (uint8_t)f[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Walk the command stream, collecting the distinct voices keyed on */
+static void FingerprintVoices(const uint8_t* buf, uint32_t size, uint32_t pos, IndexEntry_Struct* e) {
+    CurrVoice_Struct voice;
+    uint8_t regs[256] = { 0 };
+    uint64_t hashes[256];
+    uint64_t h;
+    int amd = 0, pmd = 0, count = 0, i;
+    uint32_t len;
+
+    while (pos < size && buf[pos] != 0x66) {
+        len = VGMCommandLength(buf + pos, size - pos);
+        if (len == 0 || pos + len > size) break;
+        if (buf[pos] == 0x54) {
+            uint8_t reg = buf[pos + 1], val = buf[pos + 2];
+            regs[reg] = val;
+            if (reg == 0x19) {
+                if (val & 0x80) pmd = val & 127;
+                else amd = val & 127;
+            }
+            else if (reg == 0x08 && (val & 0x78) != 0) {
+                voice = VoiceFromRegisters(regs, amd, pmd, val & 7);
+                h = HashVoice(&voice.Voice);
+                for (i = 0; i < count && hashes[i] != h; i++);
+                if (i == count && count < 256) {
+                    hashes[count++] = h;
+                    e->Fingerprint |= 1ULL << (h & 63);
+                    e->Fingerprint |= 1ULL << ((h >> 6) & 63);
+                    e->Fingerprint |= 1ULL << ((h >> 12) & 63);
+                }
+            }
+        }
+        pos += len;
+    }
+    e->Voices = count;
+}
+
+static void IndexFile(IndexEntry_Struct* e, uint8_t** buf, uint32_t* bufSize) {
+    FILE* f = NULL;
+    uint32_t size, dataPos;
+    long length;
+
+    if (fopen_s(&f, e->Path, "rb") != 0 || f == NULL) return;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (length < 0x40) { fclose(f); return; }
+    size = (uint32_t)length;
+    if (size > *bufSize) {
+        uint8_t* temp = (uint8_t*)realloc(*buf, size);
+        if (temp == NULL) { fclose(f); return; }
+        *buf = temp;
+        *bufSize = size;
+    }
+    if (fread(*buf, 1, size, f) != size) { fclose(f); return; }
+    fclose(f);
+    if (memcmp(*buf, "Vgm ", 4) != 0) return;
+
+    e->FileSize = size;
+    e->Version = (uint32_t)BytesToInt32(*buf + 0x08);
+    e->TotalSamples = (uint32_t)BytesToInt32(*buf + 0x18);
+    e->LoopSamples = (uint32_t)BytesToInt32(*buf + 0x20);
+    dataPos = (uint32_t)BytesToInt32(*buf + 0x34);
+    dataPos = (e->Version >= 0x150 && dataPos != 0) ? dataPos + 0x34 : 0x40;
+    if (e->Version >= 0x110 && dataPos >= 0x34)
+        e->Clock = (uint32_t)BytesToInt32(*buf + 0x30) & 0x3FFFFFFF;
+    ReadGD3(*buf, size, e);
+    if (e->Clock != 0)
+        FingerprintVoices(*buf, size, dataPos, e);
+    e->Valid = 1;
+}
+
+static THREAD_FUNC(IndexWorker) {
+    uint8_t* buf = NULL;
+    uint32_t bufSize = 0;
+    long i;
+
+    (void)arg;
+    while ((i = AtomicIncrement(&IndexNext) - 1) < IndexCount) {
+        IndexFile(&IndexEntries[i], &buf, &bufSize);
+    }
+    free(buf);
+    THREAD_RETURN;
+}
+
+static int CompareIndexPath(const void* a, const void* b) {
+    return strcmp(((const IndexEntry_Struct*)a)->Path, ((const IndexEntry_Struct*)b)->Path);
+}
+
+/* String table with each distinct string stored once */
+typedef struct {
+    char* Data;
+    uint32_t Length;
+    uint32_t Capacity;
+    uint32_t* Slots;        // offset + 1 of each hashed string, 0 when free
+    uint32_t SlotCount;
+} StringTable_Struct;
+
+static uint32_t AddString(StringTable_Struct* t, const char* str) {
+    uint32_t h = 2166136261u, slot, len = (uint32_t)strlen(str) + 1;
+    const char* p;
+
+    for (p = str; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 16777619u;
+    }
+    for (slot = h & (t->SlotCount - 1); t->Slots[slot] != 0; slot = (slot + 1) & (t->SlotCount - 1)) {
+        if (strcmp(t->Data + t->Slots[slot] - 1, str) == 0)
+            return t->Slots[slot] - 1;
+    }
+    if (t->Length + len > t->Capacity) {
+        uint32_t newCapacity = (t->Capacity + len) * 2;
+        char* temp = (char*)realloc(t->Data, newCapacity);
+        if (temp == NULL) return 0;
+        t->Data = temp;
+        t->Capacity = newCapacity;
+    }
+    memcpy(t->Data + t->Length, str, len);
+    t->Slots[slot] = t->Length + 1;
+    t->Length += len;
+    return t->Slots[slot] - 1;
+}
+
+static int WriteIndex(const char* path, int count, int* written) {
+    StringTable_Struct strings = { 0 };
+    uint8_t header[16];
+    uint8_t* records;
+    uint8_t* r;
+    FILE* f = NULL;
+    int i, n = 0;
+
+    strings.SlotCount = 1024;
+    while (strings.SlotCount < (uint32_t)count * 12) strings.SlotCount *= 2;
+    strings.Slots = (uint32_t*)calloc(strings.SlotCount, sizeof(uint32_t));
+    records = (uint8_t*)malloc((size_t)count * INDEX_RECORD_SIZE + 1);
+    if (strings.Slots == NULL || records == NULL) {
+        free(strings.Slots);
+        free(records);
+        return 0;
+    }
+    AddString(&strings, "");
+
+    for (i = 0; i < count; i++) {
+        IndexEntry_Struct* e = &IndexEntries[i];
+        if (!e->Valid) continue;
+        r = records + (size_t)n * INDEX_RECORD_SIZE;
+        Int32ToBytes(AddString(&strings, e->Path), r);
+        Int32ToBytes(AddString(&strings, e->Title), r + 4);
+        Int32ToBytes(AddString(&strings, e->Game), r + 8);
+        Int32ToBytes(AddString(&strings, e->System), r + 12);
+        Int32ToBytes(AddString(&strings, e->Author), r + 16);
+        Int32ToBytes(AddString(&strings, e->Date), r + 20);
+        Int32ToBytes(e->Clock, r + 24);
+        Int32ToBytes(e->Version, r + 28);
+        Int32ToBytes(e->TotalSamples, r + 32);
+        Int32ToBytes(e->LoopSamples, r + 36);
+        Int32ToBytes(e->FileSize, r + 40);
+        Int32ToBytes(e->Voices, r + 44);
+        Int32ToBytes((uint32_t)e->Fingerprint, r + 48);
+        Int32ToBytes((uint32_t)(e->Fingerprint >> 32), r + 52);
+        n++;
+    }
+
+    memcpy(header, "YMIX", 4);
+    Int32ToBytes(INDEX_VERSION, header + 4);
+    Int32ToBytes(n, header + 8);
+    Int32ToBytes(strings.Length, header + 12);
+
+    if (fopen_s(&f, path, "wb") == 0 && f != NULL) {
+        fwrite(header, 1, sizeof(header), f);
+        fwrite(records, 1, (size_t)n * INDEX_RECORD_SIZE, f);
+        fwrite(strings.Data, 1, strings.Length, f);
+        fclose(f);
+    }
+    free(strings.Slots);
+    free(strings.Data);
+    free(records);
+    *written = n;
+    return f != NULL;
+}
+
+static int IndexCommand(int argc, char* argv[]) {
+    Thread_Handle* threads;
+    int threadCount = CpuCount();
+    int i, started, written = 0, ym = 0;
+    double start;
+
+    if (argc < 4) {
+        printf("Usage: %s index <directory> <index file> [-threads <value>]\n", argv[0]);
+        return 1;
+    }
+    for (i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            threadCount = atoi(argv[++i]);
+        }
+        else {
+            printf("Error: Unknown parameter %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (threadCount < 1) threadCount = 1;
+
+    start = NowSeconds();
+    WalkVGMs(argv[2], "", 1, AddIndexPath);
+    printf("Found %d VGM files\n", IndexCount);
+
+    threads = (Thread_Handle*)malloc((size_t)threadCount * sizeof(Thread_Handle));
+    if (threads == NULL) return 1;
+    IndexNext = 0;
+    for (started = 0; started < threadCount; started++) {
+        if (!StartThread(&threads[started], IndexWorker, NULL)) break;
+    }
+    if (started == 0) {
+        printf("Cannot start index threads.\n");
+        return 1;
+    }
+    for (i = 0; i < started; i++) JoinThread(threads[i]);
+    free(threads);
+
+    qsort(IndexEntries, IndexCount, sizeof(IndexEntry_Struct), CompareIndexPath);
+    for (i = 0; i < IndexCount; i++) {
+        if (IndexEntries[i].Valid && IndexEntries[i].Clock != 0) ym++;
+    }
+    if (!WriteIndex(argv[3], IndexCount, &written)) {
+        printf("Cannot write index file %s\n", argv[3]);
+        return 1;
+    }
+    printf("Indexed %d VGM files, %d use the YM2151, in %.2f s with %d threads\n",
+        written, ym, NowSeconds() - start, started);
+    free(IndexEntries);
+    return 0;
+}
+
+static int PopCount64(uint64_t v) {
+    int n = 0;
+    while (v) { v &= v - 1; n++; }
+    return n;
+}
+
+static int ContainsText(const char* haystack, const char* needle) {
+    size_t i, j, n = strlen(haystack), m = strlen(needle);
+
+    for (i = 0; i + m <= n; i++) {
+        for (j = 0; j < m; j++) {
+            char a = haystack[i + j], b = needle[j];
+            if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+            if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+            if (a != b) break;
+        }
+        if (j == m) return 1;
+    }
+    return 0;
+}
+
+static int QueryCommand(int argc, char* argv[]) {
+    const char* game = NULL;
+    const char* title = NULL;
+    const char* author = NULL;
+    const char* like = NULL;
+    double minSec = 0, maxSec = 0, sec, score;
+    int ymOnly = 0, i, count, lo, hi, mid, cmp, matches = 0;
+    uint32_t stringSize;
+    uint64_t likeFp = 0, fp;
+    uint8_t header[16];
+    uint8_t* records;
+    uint8_t* r;
+    char* strings;
+    long fileSize;
+    FILE* f = NULL;
+
+    if (argc < 3) {
+        printf("Usage: %s query <index file> [-ym] [-game <text>] [-title <text>] [-author <text>] [-min_sec <value>] [-max_sec <value>] [-like <VGM path>]\n", argv[0]);
+        return 1;
+    }
+    for (i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-ym") == 0) ymOnly = 1;
+        else if (strcmp(argv[i], "-game") == 0 && i + 1 < argc) game = argv[++i];
+        else if (strcmp(argv[i], "-title") == 0 && i + 1 < argc) title = argv[++i];
+        else if (strcmp(argv[i], "-author") == 0 && i + 1 < argc) author = argv[++i];
+        else if (strcmp(argv[i], "-min_sec") == 0 && i + 1 < argc) minSec = atof(argv[++i]);
+        else if (strcmp(argv[i], "-max_sec") == 0 && i + 1 < argc) maxSec = atof(argv[++i]);
+        else if (strcmp(argv[i], "-like") == 0 && i + 1 < argc) like = argv[++i];
+        else {
+            printf("Error: Unknown parameter %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (fopen_s(&f, argv[2], "rb") != 0 || f == NULL) {
+        printf("Cannot open index file %s\n", argv[2]);
+        return 1;
+    }
+    if (fread(header, 1, 16, f) != 16 || memcmp(header, "YMIX", 4) != 0 || BytesToInt32(header + 4) != INDEX_VERSION) {
+        fclose(f);
+        printf("Not an index file.\n");
+        return 1;
+    }
+    count = BytesToInt32(header + 8);
+    stringSize = (uint32_t)BytesToInt32(header + 12);
+    fseek(f, 0, SEEK_END);
+    fileSize = ftell(f);
+    fseek(f, 16, SEEK_SET);
+    if (count < 0 || (double)count * INDEX_RECORD_SIZE + stringSize > (double)fileSize - 16) {
+        fclose(f);
+        printf("Index file is truncated.\n");
+        return 1;
+    }
+    records = (uint8_t*)malloc((size_t)count * INDEX_RECORD_SIZE + 1);
+    strings = (char*)malloc((size_t)stringSize + 1);
+    if (records == NULL || strings == NULL ||
+        fread(records, INDEX_RECORD_SIZE, count, f) != (size_t)count ||
+        fread(strings, 1, stringSize, f) != stringSize) {
+        fclose(f);
+        free(records);
+        free(strings);
+        printf("Index file is truncated.\n");
+        return 1;
+    }
+    fclose(f);
+    strings[stringSize] = '\0';
+
+#define REC_STR(r, field) (strings + ((uint32_t)BytesToInt32((r) + (field) * 4) % (stringSize + 1)))
+#define REC_INT(r, offset) ((uint32_t)BytesToInt32((r) + (offset)))
+
+    /* Records are sorted by path, so the reference track is a binary search away */
+    if (like != NULL) {
+        lo = 0;
+        hi = count - 1;
+        r = NULL;
+        while (lo <= hi) {
+            mid = (lo + hi) / 2;
+            cmp = strcmp(REC_STR(records + (size_t)mid * INDEX_RECORD_SIZE, 0), like);
+            if (cmp == 0) { r = records + (size_t)mid * INDEX_RECORD_SIZE; break; }
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid - 1;
+        }
+        if (r == NULL) {
+            printf("%s is not in the index\n", like);
+            free(records);
+            free(strings);
+            return 1;
+        }
+        likeFp = REC_INT(r, 48) | ((uint64_t)REC_INT(r, 52) << 32);
+    }
+
+    for (i = 0; i < count; i++) {
+        r = records + (size_t)i * INDEX_RECORD_SIZE;
+        sec = REC_INT(r, 32) / 44100.0;
+        if (ymOnly && REC_INT(r, 24) == 0) continue;
+        if (game != NULL && !ContainsText(REC_STR(r, 2), game)) continue;
+        if (title != NULL && !ContainsText(REC_STR(r, 1), title)) continue;
+        if (author != NULL && !ContainsText(REC_STR(r, 4), author)) continue;
+        if (minSec > 0 && sec < minSec) continue;
+        if (maxSec > 0 && sec > maxSec) continue;
+        if (like != NULL) {
+            fp = REC_INT(r, 48) | ((uint64_t)REC_INT(r, 52) << 32);
+            if ((fp | likeFp) == 0) continue;
+            score = (double)PopCount64(fp & likeFp) / PopCount64(fp | likeFp);
+            if (score < 0.5) continue;
+            printf("%.2f  ", score);
+        }
+        printf("%s  %7.1f s  %7u Hz  %3u voices  %s - %s\n", REC_STR(r, 0), sec,
+            REC_INT(r, 24), REC_INT(r, 44), REC_STR(r, 2), REC_STR(r, 1));
+        matches++;
+    }
+    printf("%d of %d files matched\n", matches, count);
+
+#undef REC_STR
+#undef REC_INT
+    free(records);
+    free(strings);
+    return 0;
+}
+
+static void parseArguments(int argc, char* argv[], char* inputPath, char* tracePath, char* gmLibPath) {
+    TL_Tol = 10;
+    Gain = 1.0;
+    BPM = 120;
+    TQN = 96;
+    PB_MaxErr = 0;
+    PB_MinTicks = 0;
+    Pipelined = 0;
+    GMMap = 0;
+    EGModel = 0;
+    EGExpression = 0;
+    EGBench = 0;
+    FrameBatch = 0;
+    Debug = 0;
+    inputPath[0] = '\0';
+    tracePath[0] = '\0';
+    gmLibPath[0] = '\0';
+    PackPath[0] = '\0';
+    free(InputPaths);
+    InputPaths = (char**)malloc((size_t)argc * sizeof(char*));
+    InputCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            Debug = 1;
+        }
+        else if (strcmp(argv[i], "-tl_tol") == 0 && i + 1 < argc) {
+            TL_Tol = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-gain") == 0 && i + 1 < argc) {
+            Gain = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bpm") == 0 && i + 1 < argc) {
+            BPM = atof(argv[++i]);
         }
         else if (strcmp(argv[i], "-tqn") == 0 && i + 1 < argc) {
             TQN = atoi(argv[++i]);
         }
+        else if (strcmp(argv[i], "-pb_err") == 0 && i + 1 < argc) {
+            PB_MaxErr = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-pb_min") == 0 && i + 1 < argc) {
+            PB_MinTicks = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-gm") == 0) {
+            GMMap = 1;
+        }
+        else if (strcmp(argv[i], "-gm_lib") == 0 && i + 1 < argc) {
+            GMMap = 1;
+            strncpy_s(gmLibPath, 256, argv[++i], _TRUNCATE);
+        }
+        else if (strcmp(argv[i], "-eg") == 0) {
+            EGModel = 1;
+        }
+        else if (strcmp(argv[i], "-expr") == 0) {
+            EGModel = 1;
+            EGExpression = 1;
+        }
+        else if (strcmp(argv[i], "-eg_bench") == 0) {
+            EGModel = 1;
+            EGBench = 1;
+        }
+        else if (strcmp(argv[i], "-frame") == 0) {
+            FrameBatch = 1;
+        }
+        else if (strcmp(argv[i], "-pipe") == 0) {
+            Pipelined = 1;
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+            strncpy_s(tracePath, 256, argv[++i], _TRUNCATE);
+        }
+        else if (strcmp(argv[i], "-pack") == 0 && i + 1 < argc) {
+            strncpy_s(PackPath, sizeof(PackPath), argv[++i], _TRUNCATE);
+        }
         else if (argv[i][0] == '-') {
             printf("Error: Unknown parameter %s\n", argv[i]);
             exit(1);
         }
         else {
             strncpy_s(inputPath, 256, argv[i], _TRUNCATE);
+            if (InputPaths != NULL) InputPaths[InputCount++] = argv[i];
         }
     }
 }
 
-/* --- Main --- */
-int main(int argc, char* argv[]) {
-    char inputPath[256];
-    char outPath[256];
-    char basePath[256];
-    int BPM_Period;
-    int frlp;
-    double tempD;
+/* --- Packed output ---
+   With -pack every output of a batch goes into one file instead of three files
+   per track. Layout (little-endian):
+     entry data, back to back
+     table of contents: per entry a 64-bit offset, a 32-bit size, a 16-bit
+       name length and the name
+     footer: "YMPK", version, entry count, 64-bit table of contents offset
+   Adding to an existing pack appends the new entries after the old footer,
+   then the merged table and a new footer. The old table and footer are left
+   behind as dead space rather than overwritten, so a failed run never damages
+   the entries already packed. Entry names are paths relative to the input
+   directory, separated by '/'. Names may repeat; the last entry with a name is
+   current. */
+static int ReadPackTOC(FILE* f, OutBuf_Struct* toc, int* count, long long* tocOffset) {
+    uint8_t footer[PACK_FOOTER_SIZE];
+    long long size, tocLength;
+    uint64_t position;
 
-    if (argc < 2) {
-        printf("Usage: %s [-d] [-tl_tol <value>] [-gain <value>] [-bpm <value>] [-tqn <value>] <input VGM file>\n", argv[0]);
+    FileSeek(f, 0, SEEK_END);
+    size = FileTell(f);
+    if (size < PACK_FOOTER_SIZE) return 0;
+    FileSeek(f, size - PACK_FOOTER_SIZE, SEEK_SET);
+    if (fread(footer, 1, PACK_FOOTER_SIZE, f) != PACK_FOOTER_SIZE) return 0;
+    if (memcmp(footer, "YMPK", 4) != 0 || (uint32_t)BytesToInt32(footer + 4) != PACK_VERSION) return 0;
+    *count = BytesToInt32(footer + 8);
+    position = (uint32_t)BytesToInt32(footer + 12) | ((uint64_t)(uint32_t)BytesToInt32(footer + 16) << 32);
+    if (position > (uint64_t)(size - PACK_FOOTER_SIZE)) return 0;
+    *tocOffset = (long long)position;
+    tocLength = size - PACK_FOOTER_SIZE - *tocOffset;
+
+    toc->Length = 0;
+    if (!OutReserve(toc, (size_t)tocLength)) return 0;
+    FileSeek(f, *tocOffset, SEEK_SET);
+    if (fread(toc->Data, 1, (size_t)tocLength, f) != (size_t)tocLength) return 0;
+    toc->Length = (size_t)tocLength;
+    return 1;
+}
+
+/* Read the table of contents entry at *pos, returning 0 at the end or if it is damaged.
+   Entry data must lie before the table of contents at tocOffset */
+static int NextPackEntry(OutBuf_Struct* toc, long long tocOffset, size_t* pos, long long* offset, uint32_t* size, char* name, size_t nameSize) {
+    uint8_t* p = toc->Data + *pos;
+    uint64_t position;
+    int nameLength;
+
+    if (*pos + 14 > toc->Length) return 0;
+    position = (uint32_t)BytesToInt32(p) | ((uint64_t)(uint32_t)BytesToInt32(p + 4) << 32);
+    *size = (uint32_t)BytesToInt32(p + 8);
+    if (position > (uint64_t)tocOffset || *size > (uint64_t)tocOffset - position) return 0;
+    *offset = (long long)position;
+    nameLength = BytesToInt16(p + 12);
+    if (*pos + 14 + nameLength > toc->Length) return 0;
+    BytesToText(p + 14, nameLength, name, nameSize);
+    *pos += 14 + nameLength;
+    return 1;
+}
+
+static int OpenPack(const char* path) {
+    char name[260];
+    size_t pos = 0;
+    long long offset;
+    uint32_t size;
+    int entries = 0;
+
+    PackTOC.Length = 0;
+    PackCount = 0;
+    PackTOCOffset = 0;
+    if (fopen_s(&PackFile, path, "rb+") == 0 && PackFile != NULL) {
+        FileSeek(PackFile, 0, SEEK_END);
+        if (FileTell(PackFile) > 0 && !ReadPackTOC(PackFile, &PackTOC, &PackCount, &PackTOCOffset)) {
+            printf("Not a pack file.\n");
+            fclose(PackFile);
+            PackFile = NULL;
+            return 0;
+        }
+        /* Appending rewrites the table, so a damaged one must not be carried into the new pack */
+        while (NextPackEntry(&PackTOC, PackTOCOffset, &pos, &offset, &size, name, sizeof(name))) entries++;
+        if (entries != PackCount || pos != PackTOC.Length) {
+            printf("Table of contents is damaged.\n");
+            fclose(PackFile);
+            PackFile = NULL;
+            return 0;
+        }
+        /* New entries go after the old footer; PackTOCOffset now tracks the end of the data */
+        FileSeek(PackFile, 0, SEEK_END);
+        PackTOCOffset = FileTell(PackFile);
+    }
+    else if (fopen_s(&PackFile, path, "wb+") != 0 || PackFile == NULL) {
+        PackFile = NULL;
+        return 0;
+    }
+    /* Entries are written whole from memory, so let stdio gather them into large writes */
+    setvbuf(PackFile, NULL, _IOFBF, READ_CHUNK);
+    return 1;
+}
+
+static int PackAdd(const char* name, const char* ext, OutBuf_Struct* out) {
+    char entryName[260];
+    uint8_t record[14];
+    int nameLength;
+
+    /* Only data that reached the file gets a table of contents record */
+    if (fwrite(out->Data, 1, out->Length, PackFile) != out->Length) {
+        FileSeek(PackFile, PackTOCOffset, SEEK_SET);
+        return 0;
+    }
+
+    sprintf_s(entryName, sizeof(entryName), "%s%s", name, ext);
+    nameLength = (int)strlen(entryName);
+    Int32ToBytes((uint32_t)PackTOCOffset, record);
+    Int32ToBytes((uint32_t)(PackTOCOffset >> 32), record + 4);
+    Int32ToBytes((uint32_t)out->Length, record + 8);
+    record[12] = nameLength & 0xFF;
+    record[13] = (nameLength >> 8) & 0xFF;
+    OutWrite(&PackTOC, record, 14);
+    OutWrite(&PackTOC, entryName, nameLength);
+    PackCount++;
+    PackTOCOffset += out->Length;
+    return 1;
+}
+
+static int ClosePack() {
+    uint8_t footer[PACK_FOOTER_SIZE];
+    int ok;
+
+    memcpy(footer, "YMPK", 4);
+    Int32ToBytes(PACK_VERSION, footer + 4);
+    Int32ToBytes((uint32_t)PackCount, footer + 8);
+    Int32ToBytes((uint32_t)PackTOCOffset, footer + 12);
+    Int32ToBytes((uint32_t)(PackTOCOffset >> 32), footer + 16);
+    fwrite(PackTOC.Data, 1, PackTOC.Length, PackFile);
+    fwrite(footer, 1, PACK_FOOTER_SIZE, PackFile);
+    ok = !ferror(PackFile);
+    if (fclose(PackFile) != 0) ok = 0;
+    PackFile = NULL;
+    free(PackTOC.Data);
+    memset(&PackTOC, 0, sizeof(PackTOC));
+    return ok;
+}
+
+static int ListCommand(int argc, char* argv[]) {
+    FILE* f = NULL;
+    OutBuf_Struct toc = { 0 };
+    char name[260];
+    size_t pos = 0;
+    long long offset, tocOffset, total = 0;
+    uint32_t size;
+    int count, listed = 0;
+
+    if (argc < 3) {
+        printf("Usage: %s list <pack file>\n", argv[0]);
+        return 1;
+    }
+    if (fopen_s(&f, argv[2], "rb") != 0 || f == NULL) {
+        printf("Cannot open pack file %s\n", argv[2]);
+        return 1;
+    }
+    if (!ReadPackTOC(f, &toc, &count, &tocOffset)) {
+        fclose(f);
+        free(toc.Data);
+        printf("Not a pack file.\n");
+        return 1;
+    }
+    fclose(f);
+
+    while (NextPackEntry(&toc, tocOffset, &pos, &offset, &size, name, sizeof(name))) {
+        printf("%12lld %10u  %s\n", offset, size, name);
+        total += size;
+        listed++;
+    }
+    printf("%d entries, %lld bytes\n", listed, total);
+    free(toc.Data);
+    if (listed != count) {
+        printf("Table of contents is damaged.\n");
         return 1;
     }
+    return 0;
+}
 
-    parseArguments(argc, argv, inputPath);
+/* A pack comes from anywhere, so an entry name must not lead out of the output
+   directory: only '/' may separate its parts, and no part may be empty, "." or ".." */
+static int SafePackName(const char* name) {
+    const char* part = name;
+    size_t length;
 
-    if (strlen(inputPath) == 0) {
-        printf("Error: Input file path is required\n");
+    if (strpbrk(name, "\\:") != NULL) return 0;
+    for (;;) {
+        length = strcspn(part, "/");
+        if (length == 0 || (part[0] == '.' && (length == 1 || (length == 2 && part[1] == '.')))) return 0;
+        if (part[length] == '\0') return 1;
+        part += length + 1;
+    }
+}
+
+static int ExtractCommand(int argc, char* argv[]) {
+    FILE* f = NULL;
+    FILE* out_file = NULL;
+    OutBuf_Struct toc = { 0 };
+    OutBuf_Struct data = { 0 };
+    char name[260];
+    char outPath[520];
+    char* slash;
+    const char* outDir = ".";
+    size_t pos = 0;
+    long long offset, tocOffset;
+    uint32_t size;
+    int count, i, wanted, names = 0, extracted = 0, failed = 0;
+
+    if (argc < 3) {
+        printf("Usage: %s extract <pack file> [-out <directory>] [<name>...]\n", argv[0]);
         return 1;
     }
-    
-    if (fopen_s(&in_file, inputPath, "rb") != 0 || in_file == NULL) {
-        printf("Cannot open input file %s\n", inputPath);
+    for (i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-out") == 0 && i + 1 < argc) outDir = argv[++i];
+        else names++;
+    }
+    if (fopen_s(&f, argv[2], "rb") != 0 || f == NULL) {
+        printf("Cannot open pack file %s\n", argv[2]);
+        return 1;
+    }
+    if (!ReadPackTOC(f, &toc, &count, &tocOffset)) {
+        fclose(f);
+        free(toc.Data);
+        printf("Not a pack file.\n");
         return 1;
     }
 
-    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 1; }
+    /* Entries are written in pack order, so the last copy of a repeated name is the one kept */
+    while (NextPackEntry(&toc, tocOffset, &pos, &offset, &size, name, sizeof(name))) {
+        wanted = names == 0;
+        for (i = 3; i < argc && !wanted; i++) {
+            if (strcmp(argv[i], "-out") == 0) i++;
+            else if (strcmp(argv[i], name) == 0) wanted = 1;
+        }
+        if (!wanted) continue;
+        if (!SafePackName(name)) {
+            printf("Skipping unsafe entry name %s\n", name);
+            failed++;
+            continue;
+        }
+
+        data.Length = 0;
+        if (!OutReserve(&data, size) || FileSeek(f, offset, SEEK_SET) != 0 || fread(data.Data, 1, size, f) != size) {
+            printf("Cannot read %s from the pack\n", name);
+            failed++;
+            continue;
+        }
+        sprintf_s(outPath, sizeof(outPath), "%s/%s", outDir, name);
+        for (slash = outPath + strlen(outDir) + 1; (slash = strchr(slash, '/')) != NULL; slash++) {
+            *slash = '\0';
+            MakeDirectory(outPath);
+            *slash = '/';
+        }
+        if (fopen_s(&out_file, outPath, "wb") != 0 || out_file == NULL) {
+            printf("Cannot open output file %s\n", outPath);
+            failed++;
+            continue;
+        }
+        fwrite(data.Data, 1, size, out_file);
+        fclose(out_file);
+        extracted++;
+    }
+    if (pos != toc.Length) {
+        printf("Table of contents is damaged.\n");
+        failed++;
+    }
+    fclose(f);
+    free(toc.Data);
+    free(data.Data);
+    printf("Extracted %d entries\n", extracted);
+    return failed ? 1 : 0;
+}
+
+/* --- Conversion --- */
+
+/* Outputs are written next to their final name and renamed into place, so a
+   reader never sees a half-written file */
+static int CommitOutput(const char* basePath, const char* ext) {
+    char tmpPath[280];
+    char outPath[280];
+
+    sprintf_s(tmpPath, sizeof(tmpPath), "%s.%s.tmp", basePath, ext);
+    sprintf_s(outPath, sizeof(outPath), "%s.%s", basePath, ext);
+    if (!RenameFile(tmpPath, outPath)) {
+        printf("Cannot rename %s to %s\n", tmpPath, outPath);
+        remove(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+/* Remove the .tmp outputs a failed conversion leaves behind, so they do not
+   pile up next to the watched files */
+static void RemoveTempOutputs(const char* basePath) {
+    static const char* exts[3] = { "mid", "syx", "opm" };
+    char tmpPath[280];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        sprintf_s(tmpPath, sizeof(tmpPath), "%s.%s.tmp", basePath, exts[i]);
+        remove(tmpPath);
+    }
+}
+
+static int ConvertFile(const char* inputPath, const char* outDir, const char* tracePath) {
+    char outPath[280];
+    char basePath[256];
     char header[5];
+    const char* name;
+    int BPM_Period;
+    int frlp;
+    long actualLength;
+    double tempD;
+    double convertStart, convertTime;
+
+    if (fopen_s(&in_file, inputPath, "rb") != 0 || in_file == NULL) {
+        printf("Cannot open input file %s\n", inputPath);
+        return 0;
+    }
+
+    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 0; }
     BytesToText(d, 4, header, sizeof(header));
     if (strcmp(header, "Vgm ") != 0) {
         fclose(in_file);
         printf("Not a VGM file.\n");
-        return 1;
+        return 0;
     }
 
-    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 1; }
+    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 0; }
     filelength = BytesToInt32(d) + 4;
     fseek(in_file, 0, SEEK_END);
-    long actualLength = ftell(in_file);
+    actualLength = ftell(in_file);
     if (filelength > actualLength) {
         fclose(in_file);
         printf("File length mismatch.\n");
-        return 1;
+        return 0;
     }
-    printf("File length is: %d bytes\n", filelength);
+    Info("File length is: %d bytes\n", filelength);
 
     fseek(in_file, 0x30, SEEK_SET);
-    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 1; }
+    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 0; }
     tempD = BytesToInt32(d);
     if (tempD != 0)
-        printf("YM2151 Frequency is: %.0f MHz\n", tempD);
-    else { fclose(in_file); return 1; }
+        Info("YM2151 Frequency is: %.0f MHz\n", tempD);
+    else { fclose(in_file); return 0; }
+    YMClock = tempD;
 
-    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 1; }
+    if (fread(d, 1, 4, in_file) != 4) { fclose(in_file); return 0; }
     tempD = BytesToInt32(d);
     if (tempD == 0) tempD = 12;
     filepos = (int)tempD + 0x34;
     fseek(in_file, filepos, SEEK_SET);
-    printf("Data starts at: 0x%x\n", filepos);
+    Info("Data starts at: 0x%x\n", filepos);
 
     delay_val = 0;
+    delay_ticks = 0;
 
     /* Prepare output file names by stripping extension */
-    char* dot = strrchr(inputPath, '.');
-    if (dot) *dot = '\0';
-    strncpy_s(basePath, sizeof(basePath), inputPath, _TRUNCATE);
+    if (outDir != NULL && outDir[0] != '\0') {
+        name = inputPath + strlen(inputPath);
+        while (name > inputPath && name[-1] != '/' && name[-1] != '\\') name--;
+        sprintf_s(basePath, sizeof(basePath), "%s/%s", outDir, name);
+    }
+    else {
+        strncpy_s(basePath, sizeof(basePath), inputPath, _TRUNCATE);
+    }
+    char* dot = strrchr(basePath, '.');
+    if (dot && dot > strrchr(basePath, '/') && dot > strrchr(basePath, '\\')) *dot = '\0';
 
-    sprintf_s(outPath, sizeof(outPath), "%s.mid", basePath);
-    if (fopen_s(&out_file_midi, outPath, "wb+") != 0 || out_file_midi == NULL) {
-        printf("Cannot open output MIDI file.\n");
-        return 1;
+    /* A pack gets the outputs from memory, so no file is opened per output */
+    OutMidi.Length = OutSyx.Length = OutOpm.Length = 0;
+    out_file_midi = NULL;
+    if (PackFile == NULL) {
+        sprintf_s(outPath, sizeof(outPath), "%s.mid.tmp", basePath);
+        if (fopen_s(&out_file_midi, outPath, "wb+") != 0 || out_file_midi == NULL) {
+            fclose(in_file);
+            printf("Cannot open output MIDI file.\n");
+            return 0;
+        }
     }
 
+    /* Everything a previous file on this thread may have left behind */
     MIDIByteCount = 0;
+    SampleTime = 0;
     VoicesCount = 0;
+    GMProgramsCount = 0;
+    MidiEventsCount = 0;
+    MidiDeferred = 0;
     RegisterChanged = 0;
-    Voices = NULL;
+    MaxVol = 0;
+    AMD_val = 0;
+    PMD_val = 0;
+    ym_reg = ym_val = 0;
+    memset(CurrentVoice, 0, sizeof(CurrentVoice));
     for (frlp = 0; frlp < 8; frlp++) {
+        SlotArr[frlp] = 0;
+        FrameOn[frlp] = 0;
         Note_Old[frlp] = -1;
         NoteOn_Old[frlp] = 0;
         KF_old[frlp] = -1;
@@ -806,63 +3605,675 @@ int main(int argc, char* argv[]) {
         VoiceID[frlp] = -2;
         CurrentVoice[frlp].VolumeChangeAmount = -2;
     }
+    out_file_trace = NULL;
     memset(Registers, 0, sizeof(Registers));
+    EGReset();
+    ResetFrame();
+    FrameBatched = FrameApplied = 0;
+    EGTime = 0;
+    EGBatches = 0;
 
-    printf("Ticks per quarter note = %d\n", TQN);
+    Info("Ticks per quarter note = %d\n", TQN);
+
+    if (tracePath != NULL && tracePath[0] != '\0' && !TraceOpen(tracePath)) {
+        printf("Cannot open trace file %s\n", tracePath);
+        fclose(in_file);
+        if (out_file_midi) {
+            fclose(out_file_midi);
+            RemoveTempOutputs(basePath);
+        }
+        return 0;
+    }
 
     /* Write initial MIDI header (MThd) and a track header placeholder */
     uint8_t mthd[14] = { 'M','T','h','d', 0,0,0,6, 0,1, 0,1, (uint8_t)((TQN >> 8) & 0xFF), (uint8_t)(TQN & 0xFF) };
-    fwrite(mthd, 1, 14, out_file_midi);
     uint8_t mtrk[8] = { 'M','T','r','k', 0,0,0,0 };
-    fwrite(mtrk, 1, 8, out_file_midi);
+    if (out_file_midi == NULL) {
+        OutWrite(&OutMidi, mthd, 14);
+        OutWrite(&OutMidi, mtrk, 8);
+    }
+    else {
+        fwrite(mthd, 1, 14, out_file_midi);
+        fwrite(mtrk, 1, 8, out_file_midi);
+    }
+
+    if (!StartWriter()) {
+        printf("Cannot start pipeline threads.\n");
+        if (Pipelined) RingFree(&WriteRing);
+        fclose(in_file);
+        if (out_file_midi) {
+            fclose(out_file_midi);
+            RemoveTempOutputs(basePath);
+        }
+        return 0;
+    }
+    if (Pipelined && !StartReader(filepos)) {
+        printf("Cannot start pipeline threads.\n");
+        RingStop(&WriteRing);
+        JoinThread(WriteThread);
+        RingFree(&WriteRing);
+        RingFree(&ReadRing);
+        fclose(in_file);
+        if (out_file_midi) {
+            fclose(out_file_midi);
+            RemoveTempOutputs(basePath);
+        }
+        return 0;
+    }
 
     BPM_Period = 60000000 / (int)BPM;
     Send_Midi(0xFF, 0x51, 3);
-    fputc((BPM_Period >> 16) & 0xFF, out_file_midi); MIDIByteCount++;
-    fputc((BPM_Period >> 8) & 0xFF, out_file_midi); MIDIByteCount++;
-    fputc(BPM_Period & 0xFF, out_file_midi); MIDIByteCount++;
+    MidiByte((BPM_Period >> 16) & 0xFF); MIDIByteCount++;
+    MidiByte((BPM_Period >> 8) & 0xFF); MIDIByteCount++;
+    MidiByte(BPM_Period & 0xFF); MIDIByteCount++;
 
     for (frlp = 0; frlp < 8; frlp++) {
         Send_Midi(0xE0 + frlp, 8192 & 0x7F, 8192 >> 7);
     }
 
     /* Process entire data block */
+    MidiDeferred = (PB_MaxErr > 0 || PB_MinTicks > 0 || EGModel);
+    convertStart = NowSeconds();
     ParseLoop();
+    if (EGModel) EGEndVelocities();
+    convertTime = NowSeconds() - convertStart;
+    LastConvertTime = convertTime;
+    if (out_file_trace) TraceClose();
+    if (MidiDeferred) {
+        if (PB_MaxErr > 0 || PB_MinTicks > 0) ThinPitchBends();
+        FlushMidiEvents();
+    }
 
     Send_Midi(0xFF, 0x2F, 0);  // End of track
+    StopWriter();
     WriteMIDIHeader();         // Update the track chunk length
-    fclose(out_file_midi);
+    if (out_file_midi) fclose(out_file_midi);
 
-    sprintf_s(outPath, sizeof(outPath), "%s.syx", basePath);
-    if (fopen_s(&out_file_syx, outPath, "wb") != 0 || out_file_syx == NULL) {
-        printf("Cannot open output SYX file.\n");
-        return 1;
+    if (Pipelined) {
+        RingReport("Read", &ReadRing);
+        Info("Read ring: %lld bytes of data blocks seeked over\n", ReadRing.Skipped);
+        RingReport("Write", &WriteRing);
+        RingFree(&ReadRing);
+        RingFree(&WriteRing);
     }
 
-    sprintf_s(outPath, sizeof(outPath), "%s.opm", basePath);
-    if (fopen_s(&out_file_opm, outPath, "w") != 0 || out_file_opm == NULL) {
-        printf("Cannot open output OPM file.\n");
-        return 1;
+    WriteInsts(basePath);
+
+    if (PackFile != NULL) {
+        if (!PackAdd(PackEntryName, ".mid", &OutMidi) || !PackAdd(PackEntryName, ".syx", &OutSyx) || !PackAdd(PackEntryName, ".opm", &OutOpm)) {
+            printf("Cannot write pack file.\n");
+            return 0;
+        }
     }
+    else {
+        sprintf_s(outPath, sizeof(outPath), "%s.syx.tmp", basePath);
+        if (fopen_s(&out_file_syx, outPath, "wb") != 0 || out_file_syx == NULL) {
+            printf("Cannot open output SYX file.\n");
+            RemoveTempOutputs(basePath);
+            return 0;
+        }
+        fwrite(OutSyx.Data, 1, OutSyx.Length, out_file_syx);
+        fclose(out_file_syx);
 
-    WriteInsts(basePath);
+        sprintf_s(outPath, sizeof(outPath), "%s.opm.tmp", basePath);
+        if (fopen_s(&out_file_opm, outPath, "w") != 0 || out_file_opm == NULL) {
+            printf("Cannot open output OPM file.\n");
+            RemoveTempOutputs(basePath);
+            return 0;
+        }
+        fwrite(OutOpm.Data, 1, OutOpm.Length, out_file_opm);
+        fclose(out_file_opm);
 
-    fclose(out_file_syx);
-    fclose(out_file_opm);
+        /* The .mid goes last: the watch daemon treats it as the sign of a finished file */
+        if (!CommitOutput(basePath, "syx") || !CommitOutput(basePath, "opm") || !CommitOutput(basePath, "mid")) {
+            RemoveTempOutputs(basePath);
+            return 0;
+        }
+    }
 
-    printf("Number of voices found: %d\n", VoicesCount);
+    Info("Number of voices found: %d\n", VoicesCount);
+    if (GMMap) ReportGMMap();
+    if (FrameBatch)
+        Info("Frame batching: %lld key writes applied as %lld\n", FrameBatched, FrameApplied);
+    if (EGModel) {
+        Info("Envelope model: %.3f ms over %lld waits, %.1f%% of %.3f ms conversion\n",
+            EGTime * 1000, EGBatches, convertTime > 0 ? EGTime * 100 / convertTime : 0.0, convertTime * 1000);
+    }
     if (MaxVol == 0) {
-        printf("Maximum volume was: 0 out of 127\n");
-        printf("Gain not computed because no volume change occurred.\n");
+        Info("Maximum volume was: 0 out of 127\n");
+        Info("Gain not computed because no volume change occurred.\n");
     }
     else {
         tempD = floor(MaxVol * 1000) / 1000.0;
-        printf("Maximum volume was: %.3f out of 127\n", tempD);
+        Info("Maximum volume was: %.3f out of 127\n", tempD);
         tempD = floor(((127.0 / MaxVol) * Gain) * 1000) / 1000.0;
-        printf("Set gain to: %.3f to get best result\n", tempD);
+        Info("Set gain to: %.3f to get best result\n", tempD);
     }
-    printf("Conversion complete\n");
+    Info("Conversion complete\n");
+    return 1;
+}
 
-    free(Voices);
+/* --- Watch daemon ---
+   Files dropped into the watched directory are queued and converted by a pool
+   of workers that stay up between files. Every per-conversion global is
+   thread-local, so each worker keeps its own voice table, event queue and MIDI
+   buffer warm across conversions. A job stays in WatchJobs while it is being
+   converted so that a rewrite of the same file waits for the running
+   conversion rather than racing it. */
+static void EnqueueWatch(const char* path) {
+    double now = NowSeconds();
+    int i;
+
+    MutexLock(&WatchLock);
+    for (i = 0; i < WatchJobsCount; i++) {
+        if (strcmp(WatchJobs[i].Path, path) == 0) {
+            if (WatchJobs[i].Busy)
+                WatchJobs[i].Again = 1;
+            WatchJobs[i].Ready = now + WATCH_SETTLE;
+            MutexUnlock(&WatchLock);
+            return;
+        }
+    }
+    if (WatchJobsCount == WatchJobsCapacity) {
+        int newCapacity = WatchJobsCapacity ? WatchJobsCapacity * 2 : 64;
+        WatchJob_Struct* temp = (WatchJob_Struct*)realloc(WatchJobs, (size_t)newCapacity * sizeof(WatchJob_Struct));
+        if (temp == NULL) {
+            fprintf(stderr, "Memory allocation failed in EnqueueWatch()\n");
+            MutexUnlock(&WatchLock);
+            return;
+        }
+        WatchJobs = temp;
+        WatchJobsCapacity = newCapacity;
+    }
+    memset(&WatchJobs[WatchJobsCount], 0, sizeof(WatchJob_Struct));
+    strncpy_s(WatchJobs[WatchJobsCount].Path, sizeof(WatchJobs[WatchJobsCount].Path), path, _TRUNCATE);
+    WatchJobs[WatchJobsCount].Queued = now;
+    WatchJobs[WatchJobsCount].Ready = now + WATCH_SETTLE;
+    WatchJobsCount++;
+    CondSignal(&WatchWake);
+    MutexUnlock(&WatchLock);
+}
+
+static void EnqueueWatchName(const char* dir, const char* name) {
+    char path[260];
+
+    if (!HasExtension(name, ".vgm")) return;
+    if (!JoinPath(path, sizeof(path), dir, name)) return;
+    EnqueueWatch(path);
+}
+
+/* Queue the file if its MIDI output is missing or older than the VGM */
+static void QueueIfStale(const char* path, const char* name) {
+    char base[260];
+    char midPath[280];
+    char* dot;
+
+    if (WatchOutDir[0] != '\0') {
+        if (!JoinPath(base, sizeof(base), WatchOutDir, name)) return;
+    }
+    else
+        strncpy_s(base, sizeof(base), path, _TRUNCATE);
+    dot = strrchr(base, '.');
+    if (dot) *dot = '\0';
+    sprintf_s(midPath, sizeof(midPath), "%s.mid", base);
+    if (FileTime(midPath) < FileTime(path))
+        EnqueueWatch(path);
+}
+
+static void ScanWatchDir(const char* dir) {
+    WalkVGMs(dir, "", 0, QueueIfStale);
+}
+
+static int NextWatchJob(char* path, size_t pathSize, double* queued) {
+    double now = NowSeconds();
+    int i;
+
+    for (i = 0; i < WatchJobsCount; i++) {
+        if (!WatchJobs[i].Busy && WatchJobs[i].Ready <= now) {
+            WatchJobs[i].Busy = 1;
+            strncpy_s(path, pathSize, WatchJobs[i].Path, _TRUNCATE);
+            *queued = WatchJobs[i].Queued;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void FinishWatchJob(const char* path, double queued, double convertTime, int ok) {
+    double now = NowSeconds();
+    double latency = now - queued;
+    WatchRecent_Struct* recent;
+    int i;
+
+    for (i = 0; i < WatchJobsCount; i++) {
+        if (strcmp(WatchJobs[i].Path, path) != 0) continue;
+        if (WatchJobs[i].Again) {
+            WatchJobs[i].Busy = 0;
+            WatchJobs[i].Again = 0;
+            WatchJobs[i].Queued = now;
+        }
+        else {
+            memmove(&WatchJobs[i], &WatchJobs[i + 1], (size_t)(WatchJobsCount - i - 1) * sizeof(WatchJob_Struct));
+            WatchJobsCount--;
+        }
+        break;
+    }
+
+    if (ok) WatchConverted++;
+    else WatchFailed++;
+    WatchLatencyLast = latency;
+    WatchLatencySum += latency;
+    if (latency > WatchLatencyMax) WatchLatencyMax = latency;
+    recent = &WatchRecent[WatchRecentNext++ % WATCH_RECENT];
+    strncpy_s(recent->Path, sizeof(recent->Path), path, _TRUNCATE);
+    recent->Latency = latency;
+    recent->Convert = convertTime;
+    recent->Ok = ok;
+    printf("%s %s in %.2f ms (%.2f ms after queueing)\n", ok ? "Converted" : "Failed", path,
+        convertTime * 1000, latency * 1000);
+    fflush(stdout);
+}
+
+static THREAD_FUNC(WatchWorker) {
+    char path[260];
+    double queued, start, convertTime;
+    int ok;
+
+    (void)arg;
+    MutexLock(&WatchLock);
+    for (;;) {
+        if (!NextWatchJob(path, sizeof(path), &queued)) {
+            /* Settling jobs become ready without an event, so wake up to look */
+            CondWait(&WatchWake, &WatchLock, 100);
+            continue;
+        }
+        WatchActive++;
+        MutexUnlock(&WatchLock);
+
+        start = NowSeconds();
+        ok = ConvertFile(path, WatchOutDir, NULL);
+        convertTime = NowSeconds() - start;
+
+        MutexLock(&WatchLock);
+        WatchActive--;
+        FinishWatchJob(path, queued, convertTime, ok);
+    }
+    THREAD_RETURN;
+}
+
+/* Append a JSON string, escaping the characters JSON reserves */
+static int JsonString(char* out, int pos, int size, const char* text) {
+    if (pos < size) out[pos++] = '"';
+    for (; *text != '\0' && pos + 7 < size; text++) {
+        if (*text == '"' || *text == '\\') {
+            out[pos++] = '\\';
+            out[pos++] = *text;
+        }
+        else if ((unsigned char)*text < 0x20) {
+            pos += sprintf_s(out + pos, size - pos, "\\u%04x", (unsigned char)*text);
+        }
+        else {
+            out[pos++] = *text;
+        }
+    }
+    if (pos < size) out[pos++] = '"';
+    return pos;
+}
+
+/* One JSON object per connection, then the connection is closed */
+static int WatchReport(char* out, int size) {
+    int pos, i, n, count;
+    int queued = 0;
+    WatchRecent_Struct* recent;
+
+    MutexLock(&WatchLock);
+    for (i = 0; i < WatchJobsCount; i++) {
+        if (!WatchJobs[i].Busy || WatchJobs[i].Again) queued++;
+    }
+    count = WatchRecentNext < WATCH_RECENT ? WatchRecentNext : WATCH_RECENT;
+    pos = sprintf_s(out, size,
+        "{\"queue_depth\":%d,\"active\":%d,\"converted\":%lld,\"failed\":%lld,"
+        "\"latency_ms\":{\"last\":%.3f,\"avg\":%.3f,\"max\":%.3f},\"recent\":[",
+        queued, WatchActive, WatchConverted, WatchFailed, WatchLatencyLast * 1000,
+        WatchConverted + WatchFailed > 0 ? WatchLatencySum * 1000 / (WatchConverted + WatchFailed) : 0.0,
+        WatchLatencyMax * 1000);
+    for (i = 0; i < count && pos < size - 512; i++) {
+        recent = &WatchRecent[(WatchRecentNext - 1 - i) % WATCH_RECENT];
+        if (i > 0) out[pos++] = ',';
+        pos += sprintf_s(out + pos, size - pos, "{\"file\":");
+        pos = JsonString(out, pos, size - 256, recent->Path);
+        n = sprintf_s(out + pos, size - pos, ",\"ok\":%s,\"latency_ms\":%.3f,\"convert_ms\":%.3f}",
+            recent->Ok ? "true" : "false", recent->Latency * 1000, recent->Convert * 1000);
+        if (n > 0) pos += n;
+    }
+    MutexUnlock(&WatchLock);
+    pos += sprintf_s(out + pos, size - pos, "]}\n");
+    return pos;
+}
+
+static THREAD_FUNC(WatchStatusThread) {
+    Socket_Handle server = *(Socket_Handle*)arg;
+    Socket_Handle client;
+    char report[16384];
+    int length;
+
+    for (;;) {
+        client = accept(server, NULL, NULL);
+        if (client == INVALID_SOCKET) continue;
+        length = WatchReport(report, sizeof(report));
+        send(client, report, length, MSG_NOSIGNAL);
+        CloseSocket(client);
+    }
+    THREAD_RETURN;
+}
+
+static int StartWatchStatus(Thread_Handle* thread, Socket_Handle* server) {
+    struct sockaddr_un addr;
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return 0;
+#endif
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy_s(addr.sun_path, sizeof(addr.sun_path), WatchStatus, _TRUNCATE);
+    remove(WatchStatus);
+    *server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*server == INVALID_SOCKET) return 0;
+    if (bind(*server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(*server, 8) != 0) {
+        CloseSocket(*server);
+        return 0;
+    }
+    return StartThread(thread, WatchStatusThread, server);
+}
+
+/* Runs until the process is killed, queueing files as they are written or moved in */
+/* Queue files as they are written. The existing files are scanned only once
+   the watch is in place, so a file that arrives in between is not missed, and
+   again whenever the system drops events because too many arrived at once. */
+static int WatchLoop(const char* dir) {
+#ifdef _WIN32
+    DWORD buffer[16384];
+    DWORD length;
+    FILE_NOTIFY_INFORMATION* info;
+    OVERLAPPED overlapped;
+    char name[260];
+    int n, scanned = 0;
+    HANDLE handle = CreateFileA(dir, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+
+    if (handle == INVALID_HANDLE_VALUE) return 0;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        CloseHandle(handle);
+        return 0;
+    }
+    while (ReadDirectoryChangesW(handle, buffer, sizeof(buffer), FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE, NULL, &overlapped, NULL)) {
+        if (!scanned) {
+            ScanWatchDir(dir);
+            scanned = 1;
+        }
+        if (!GetOverlappedResult(handle, &overlapped, &length, TRUE)) break;
+        /* A result with no entries means the change buffer overflowed */
+        if (length == 0) ScanWatchDir(dir);
+        info = (FILE_NOTIFY_INFORMATION*)buffer;
+        while (length > 0) {
+            if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_MODIFIED || info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                n = WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / 2, name, sizeof(name) - 1, NULL, NULL);
+                name[n] = '\0';
+                EnqueueWatchName(dir, name);
+            }
+            if (info->NextEntryOffset == 0) break;
+            info = (FILE_NOTIFY_INFORMATION*)((uint8_t*)info + info->NextEntryOffset);
+        }
+    }
+    CloseHandle(overlapped.hEvent);
+    CloseHandle(handle);
     return 0;
-}
\ No newline at end of file
+#else
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* event;
+    long length, pos;
+    int fd = inotify_init();
+
+    if (fd < 0) return 0;
+    /* Close-after-write rather than modify, so a file is queued once it is complete */
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        return 0;
+    }
+    ScanWatchDir(dir);
+    while ((length = (long)read(fd, buffer, sizeof(buffer))) > 0) {
+        for (pos = 0; pos < length; pos += (long)sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event*)(buffer + pos);
+            if (event->mask & IN_Q_OVERFLOW)
+                ScanWatchDir(dir);
+            else if (event->len > 0 && !(event->mask & IN_ISDIR))
+                EnqueueWatchName(dir, event->name);
+        }
+    }
+    close(fd);
+    return 0;
+#endif
+}
+
+static int WatchCommand(int argc, char* argv[]) {
+    char watchDir[256];
+    char tracePath[256];
+    char gmLibPath[256];
+    char** args;
+    int argsCount = 0;
+    int threads = 0;
+    int i;
+    Thread_Handle* workers;
+    Thread_Handle statusThread;
+    static Socket_Handle statusSocket;
+
+    if (argc < 3) {
+        printf("Usage: %s watch <directory> [-out <directory>] [-threads <value>] [-status <socket>] [conversion options]\n", argv[0]);
+        return 1;
+    }
+
+    /* Take the daemon's own options out and leave the rest to parseArguments() */
+    WatchOutDir[0] = '\0';
+    WatchStatus[0] = '\0';
+    args = (char**)malloc((size_t)argc * sizeof(char*));
+    if (args == NULL) return 1;
+    args[argsCount++] = argv[0];
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+            strncpy_s(WatchOutDir, sizeof(WatchOutDir), argv[++i], _TRUNCATE);
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-status") == 0 && i + 1 < argc)
+            strncpy_s(WatchStatus, sizeof(WatchStatus), argv[++i], _TRUNCATE);
+        else
+            args[argsCount++] = argv[i];
+    }
+    parseArguments(argsCount, args, watchDir, tracePath, gmLibPath);
+    free(args);
+    if (tracePath[0] != '\0')
+        printf("Ignoring -trace in watch mode\n");
+    if (threads <= 0) threads = CpuCount();
+    if (threads <= 0) threads = 1;
+
+    if (GMMap && !InitGMMap(gmLibPath))
+        return 1;
+
+    Verbose = 0;
+    MutexInit(&WatchLock);
+    CondInit(&WatchWake);
+
+    if (WatchStatus[0] != '\0' && !StartWatchStatus(&statusThread, &statusSocket)) {
+        printf("Cannot open status socket %s\n", WatchStatus);
+        return 1;
+    }
+
+    workers = (Thread_Handle*)malloc((size_t)threads * sizeof(Thread_Handle));
+    if (workers == NULL) return 1;
+    for (i = 0; i < threads; i++) {
+        if (!StartThread(&workers[i], WatchWorker, NULL)) {
+            printf("Cannot start watch threads.\n");
+            return 1;
+        }
+    }
+
+    printf("Watching %s with %d threads\n", watchDir, threads);
+    fflush(stdout);
+    if (!WatchLoop(watchDir))
+        printf("Cannot watch directory %s\n", watchDir);
+    return 1;
+}
+
+/* Queue a file for the pack under the given entry name, dropping its extension */
+static void AddPackInput(const char* path, const char* name) {
+    PackInput_Struct* input;
+    char* dot;
+
+    if (PackInputsCount == PackInputsCapacity) {
+        int newCapacity = PackInputsCapacity ? PackInputsCapacity * 2 : 256;
+        PackInput_Struct* temp = (PackInput_Struct*)realloc(PackInputs, (size_t)newCapacity * sizeof(PackInput_Struct));
+        if (temp == NULL) {
+            fprintf(stderr, "Memory allocation failed in AddPackInput()\n");
+            return;
+        }
+        PackInputs = temp;
+        PackInputsCapacity = newCapacity;
+    }
+    input = &PackInputs[PackInputsCount++];
+    strncpy_s(input->Path, sizeof(input->Path), path, _TRUNCATE);
+    strncpy_s(input->Name, sizeof(input->Name), name, _TRUNCATE);
+    dot = strrchr(input->Name, '.');
+    if (dot && dot > strrchr(input->Name, '/')) *dot = '\0';
+}
+
+/* Convert every input, expanding directories, into the pack named by -pack */
+static int PackCommand(const char* tracePath) {
+    double start = NowSeconds();
+    const char* name;
+    int i, before, converted = 0, failed = 0;
+
+    for (i = 0; i < InputCount; i++) {
+        if (IsDirectory(InputPaths[i])) {
+            before = PackInputsCount;
+            WalkVGMs(InputPaths[i], "", 1, AddPackInput);
+            if (PackInputsCount == before) printf("No VGM files in %s\n", InputPaths[i]);
+            continue;
+        }
+        name = InputPaths[i] + strlen(InputPaths[i]);
+        while (name > InputPaths[i] && name[-1] != '/' && name[-1] != '\\') name--;
+        AddPackInput(InputPaths[i], name);
+    }
+    if (tracePath[0] != '\0')
+        printf("Ignoring -trace with -pack\n");
+    if (!OpenPack(PackPath)) {
+        printf("Cannot open pack file %s\n", PackPath);
+        return 0;
+    }
+
+    Verbose = 0;
+    for (i = 0; i < PackInputsCount; i++) {
+        PackEntryName = PackInputs[i].Name;
+        if (ConvertFile(PackInputs[i].Path, NULL, NULL)) {
+            printf("Packed %s as %s, %d voices\n", PackInputs[i].Path, PackInputs[i].Name, VoicesCount);
+            converted++;
+        }
+        else {
+            printf("Failed %s\n", PackInputs[i].Path);
+            failed++;
+        }
+    }
+    PackEntryName = NULL;
+    free(PackInputs);
+    PackInputs = NULL;
+    PackInputsCount = PackInputsCapacity = 0;
+
+    if (!ClosePack()) {
+        printf("Cannot write pack file %s\n", PackPath);
+        return 0;
+    }
+    printf("Packed %d files (%d failed) into %s in %.2f s\n", converted, failed, PackPath, NowSeconds() - start);
+    return failed == 0;
+}
+
+/* Time the conversion with and without the envelope model, best of
+   EG_BENCH_RUNS each, leaving the outputs of a run with the model */
+#define EG_BENCH_RUNS 3
+static int EGBenchCommand(const char* inputPath) {
+    double plain = 1e9, model = 1e9;
+    int expression = EGExpression, run;
+
+    Verbose = 0;
+    for (run = 0; run < EG_BENCH_RUNS; run++) {
+        EGModel = EGExpression = 0;
+        if (!ConvertFile(inputPath, NULL, NULL)) return 0;
+        if (LastConvertTime < plain) plain = LastConvertTime;
+
+        EGModel = 1;
+        EGExpression = expression;
+        Verbose = run == EG_BENCH_RUNS - 1;
+        if (!ConvertFile(inputPath, NULL, NULL)) return 0;
+        if (LastConvertTime < model) model = LastConvertTime;
+        Verbose = 0;
+    }
+    printf("Envelope model benchmark, best of %d: %.3f ms plain, %.3f ms with the model (%+.1f%%)\n",
+        EG_BENCH_RUNS, plain * 1000, model * 1000, plain > 0 ? (model - plain) * 100 / plain : 0.0);
+    return 1;
+}
+
+/* --- Main --- */
+int main(int argc, char* argv[]) {
+    char inputPath[256];
+    char tracePath[256];
+    char gmLibPath[256];
+    int result;
+
+    if (argc >= 2 && strcmp(argv[1], "index") == 0)
+        return IndexCommand(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "query") == 0)
+        return QueryCommand(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "watch") == 0)
+        return WatchCommand(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "list") == 0)
+        return ListCommand(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "extract") == 0)
+        return ExtractCommand(argc, argv);
+
+    if (argc < 2) {
+        printf("Usage: %s [-d] [-tl_tol <value>] [-gain <value>] [-bpm <value>] [-tqn <value>] [-pb_err <cents>] [-pb_min <ticks>] [-trace <file>] [-pipe] [-gm_lib <OPM file>] [-eg] [-expr] [-eg_bench] [-frame] <input VGM file>\n", argv[0]);
+        printf("       %s -pack <pack file> [conversion options] <VGM file or directory>...\n", argv[0]);
+        printf("       %s watch <directory> [-out <directory>] [-threads <value>] [-status <socket>] [conversion options]\n", argv[0]);
+        return 1;
+    }
+
+    parseArguments(argc, argv, inputPath, tracePath, gmLibPath);
+
+    if (strlen(inputPath) == 0) {
+        printf("Error: Input file path is required\n");
+        return 1;
+    }
+    
+    if (GMMap && !InitGMMap(gmLibPath))
+        return 1;
+
+    if (PackPath[0] != '\0')
+        result = PackCommand(tracePath);
+    else if (EGBench)
+        result = EGBenchCommand(inputPath);
+    else
+        result = ConvertFile(inputPath, NULL, tracePath);
+
+    free(InputPaths);
+    free(Voices);
+    free(MidiEvents);
+    free(MidiOwnBuf);
+    free(OutMidi.Data);
+    free(OutSyx.Data);
+    free(OutOpm.Data);
+    free(GMPrograms);
+    free(GMDistances);
+    FreeGMMap();
+    return result ? 0 : 1;
+}